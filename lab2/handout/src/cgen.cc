@@ -7,6 +7,8 @@
 #define EXTERN
 #define LAB2
 #include "cgen.h"
+#include <algorithm>
+#include <cstdint>
 #include <fstream>
 #include <sstream>
 #include <string>
@@ -324,9 +326,36 @@ void CgenClassTable::setup_external_functions() {
   args_OBJECT_.push_back(OBJECT);
   vp.declare(*ct_stream, OBJECT, "Object_new", args_OBJECT_new);
   vp.declare(*ct_stream, OBJECT, "Object_abort", args_OBJECT_);
-  vp.declare(*ct_stream, OBJECT, "Object_type_name", args_OBJECT_);
+  vp.declare(*ct_stream, STRING, "Object_type_name", args_OBJECT_);
   vp.declare(*ct_stream, OBJECT, "Object_copy", args_OBJECT_);
 
+  // runtime allocation: every X_new gets its storage from the runtime arena
+  std::vector<op_type> args_OBJECT_alloc;
+  args_OBJECT_alloc.push_back(op_type("_Object_vtable", 1));
+  std::vector<op_type> args_cool_alloc;
+  args_cool_alloc.push_back(i32_type);
+  vp.declare(*ct_stream, OBJECT, "Object_alloc", args_OBJECT_alloc);
+  vp.declare(*ct_stream, i8ptr_type, "cool_alloc", args_cool_alloc);
+
+  // shadow stack for the garbage collector
+  std::vector<op_type> gc_frame_fields;
+  gc_frame_fields.push_back(op_type("_GcFrame", 1));
+  gc_frame_fields.push_back(i32_type);
+  gc_frame_fields.push_back(op_type("Object", 2));
+  vp.type_define(*ct_stream, "_GcFrame", gc_frame_fields);
+  std::vector<op_type> args_gc_push;
+  args_gc_push.push_back(op_type("_GcFrame", 1));
+  args_gc_push.push_back(op_type("Object", 2));
+  args_gc_push.push_back(i32_type);
+  std::vector<op_type> args_gc_pop;
+  args_gc_pop.push_back(op_type("_GcFrame", 1));
+  vp.declare(*ct_stream, void_type, "cool_gc_push_frame", args_gc_push);
+  vp.declare(*ct_stream, void_type, "cool_gc_pop_frame", args_gc_pop);
+  std::vector<op_type> args_gc_barrier;
+  args_gc_barrier.push_back(OBJECT);
+  args_gc_barrier.push_back(i8ptr_type);
+  vp.declare(*ct_stream, void_type, "cool_gc_write_barrier", args_gc_barrier);
+
     op_type IO("IO*");
     std::vector<op_type> args_IO_new;
     std::vector<op_type> args_IO_out_str;
@@ -358,14 +387,21 @@ void CgenClassTable::setup_external_functions() {
     vp.declare(*ct_stream, i32_type, "String_length", args_STR_length);
     vp.declare(*ct_stream, STRING, "String_concat", args_STR_concat);
     vp.declare(*ct_stream, STRING, "String_substr", args_STR_substring);
+    std::vector<op_type> args_STR_equal;
+    args_STR_equal.push_back(STRING);
+    args_STR_equal.push_back(STRING);
+    vp.declare(*ct_stream, op_type(INT1), "String_equal", args_STR_equal);
 
-    op_type INT("INT*");
+    op_type INT("Int*");
     std::vector<op_type> args_INT_new;
     std::vector<op_type> args_INT_init;
     args_INT_init.push_back(INT);
     args_INT_init.push_back(i32_type);
+    std::vector<op_type> args_INT_box;
+    args_INT_box.push_back(i32_type);
     vp.declare(*ct_stream, INT, "Int_new", args_INT_new);
     vp.declare(*ct_stream, void_type, "Int_init", args_INT_init);
+    vp.declare(*ct_stream, INT, "Int_box", args_INT_box);
 
     op_type BOOL("Bool*");
     std::vector<op_type> args_BOOL_new;
@@ -374,6 +410,9 @@ void CgenClassTable::setup_external_functions() {
     args_BOOL_init.push_back(op_type(INT1));
     vp.declare(*ct_stream, BOOL, "Bool_new", args_BOOL_new);
     vp.declare(*ct_stream, void_type, "Bool_init", args_BOOL_init);
+    std::vector<op_type> args_BOOL_box;
+    args_BOOL_box.push_back(op_type(INT1));
+    vp.declare(*ct_stream, BOOL, "Bool_box", args_BOOL_box);
 
 #endif
 }
@@ -391,11 +430,77 @@ void CgenClassTable::setup_classes(CgenNode *c, int depth) {
 void CgenClassTable::setup() {
   setup_external_functions();
   setup_classes(root(), 0);
+  by_tag.resize(current_tag);
+  for (auto node : nds)
+    by_tag[node->get_tag()] = node;
+#ifdef LAB2
+  // Constants of a struct type can only follow its definition, so every
+  // type is defined before any of them
+  for (auto node : nds) {
+    node->code_types();
+  }
+  for (auto node : nds) {
+    node->code_vtable();
+    node->code_ptrmap();
+    node->code_type_name();
+  }
+  code_ptrmap_table();
+  code_new_table();
+#endif
+}
+
+#ifdef LAB2
+// The collector finds each class's pointer map through its vtable tag
+void CgenClassTable::code_ptrmap_table() {
+  ValuePrinter vp(*ct_stream);
+  std::string maps = "[";
+  for (int i = 0; i < current_tag; i++) {
+    CgenNode *node = by_tag[i];
+    std::string map = "i32* null";
+    if (node->get_ptrmap_size() > 0) {
+      op_arr_type map_type(INT32, node->get_ptrmap_size());
+      map = "i32* getelementptr (" + map_type.get_name() + ", " +
+            map_type.get_name() + "* @" + node->get_ptrmap_name() +
+            ", i32 0, i32 0)";
+    }
+    maps += (i ? ", " : "") + map;
+  }
+  maps += "]";
+  vp.init_constant("_ptrmap_table",
+                   const_value(op_arr_type(INT32_PTR, current_tag), maps, false));
+}
+
+// new SELF_TYPE creates an object of the class of self, which is only known
+// at run time, through this table of the X_new functions indexed by tag
+void CgenClassTable::code_new_table() {
+  ValuePrinter vp(*ct_stream);
+  std::string inits = "[";
+  for (int i = 0; i < current_tag; i++) {
+    CgenNode *node = by_tag[i];
+    op_func_type init_type(op_type(node->get_type_name(), 1),
+                           std::vector<op_type>());
+    inits += std::string(i ? ", " : "") + "i8* bitcast (" +
+             init_type.get_name() + " @" + node->get_init_function_name() +
+             " to i8*)";
+  }
+  inits += "]";
+  vp.init_constant("_new_table",
+                   const_value(op_arr_type(INT8_PTR, current_tag), inits, false));
 }
+#endif
 
 // The code generation second pass. Add code here to traverse the tree and
 // emit code for each CgenNode
 void CgenClassTable::code_module() {
+#ifdef LAB2
+  // Simplify every method before any of them is analysed or emitted, and
+  // before the constants the folding adds are written out
+  for (auto node : nds) {
+    node->fold_features();
+  }
+  // String variables and attributes start out as the empty String
+  stringtable.add_string("");
+#endif
   code_constants();
 
 #ifndef LAB2
@@ -430,6 +535,8 @@ void CgenClassTable::code_classes(CgenNode *c) {
 void CgenClassTable::code_constants() {
 #ifdef LAB2
   // TODO: add code here
+  stringtable.code_string_table(*ct_stream, this);
+  inttable.code_int_table(*ct_stream, this);
 #endif
 }
 
@@ -468,15 +575,24 @@ void CgenClassTable::code_main(){
 //    main.call(*ct_stream, arg_types, "Main_main", true, args, main_ret);
     vp.define(op_type(INT32), "main", std::vector<operand>());
     vp.begin_block("entry");
-    operand main_ptr(op_type("Main*"), "main_object");
-    vp.call(*ct_stream, std::vector<op_type>(), "Main_new", true, std::vector<operand>(), main_ptr);
-    std::vector<op_type> args;
-    args.push_back(op_type("Main*"));
-    std::vector<operand> args2;
-    args2.push_back(main_ptr);
-    operand result(op_type("Object*"), "main_ret");
-    vp.call(*ct_stream, args, "Main::main", true, args2, result);
+#ifdef LAB2
+    // (new Main).main(), which Main may inherit
+    CgenNode *main_class = find(Main);
+    CgenNode *owner;
+    method_class *main_method = main_class->find_method(Mainmain, owner);
+    operand main_obj = vp.call(std::vector<op_type>(),
+                               op_type(main_class->get_type_name(), 1),
+                               main_class->get_init_function_name(), true,
+                               std::vector<operand>());
+    std::vector<op_type> arg_types;
+    arg_types.push_back(owner->type_identifier(SELF_TYPE));
+    std::vector<operand> args;
+    args.push_back(owner == main_class ? main_obj
+                                       : vp.bitcast(main_obj, arg_types[0]));
+    vp.call(arg_types, owner->type_identifier(main_method->get_return_type()),
+            owner->get_type_name() + "_" + Mainmain->get_string(), true, args);
     vp.ret(int_value(0));
+#endif
 
 #ifdef LAB2
 // LAB2
@@ -535,7 +651,8 @@ CgenNode *CgenClassTable::getMainmain(CgenNode *c) {
  constant definitions and references.
 
  All integer constants are listed in the global "inttable" and have
- type IntEntry. IntEntry methods are defined for Int constant references only.
+ type IntEntry. IntEntry methods are defined both for Int constant
+ definitions and references.
 
  Since there are only two Bool values, there is no need for a table.
  The two booleans are represented by instances of the class BoolConst,
@@ -551,9 +668,45 @@ void StrTable::code_string_table(std::ostream &s, CgenClassTable *ct) {
 }
 
 // generate code to define a global string constant
+// The String object carries the byte length so the runtime never has to
+// strlen a literal; its capacity is 0 since the bytes are not heap storage.
 void StringEntry::code_def(std::ostream &s, CgenClassTable *ct) {
 #ifdef LAB2
-  // TODO: add code here
+  ValuePrinter vp(s);
+  std::string index = std::to_string(get_index());
+  int len = get_string().size();
+  op_arr_type bytes_type(INT8, len + 1);
+  vp.init_constant("str." + index,
+                   const_value(bytes_type, get_string(), true));
+
+  std::string bytes = "getelementptr (" + bytes_type.get_name() + ", " +
+                      bytes_type.get_name() + "* @str." + index +
+                      ", i32 0, i32 0)";
+  std::string fields = "{ %_String_vtable* @_String_vtable_prototype, i8* " +
+                       bytes + ", i32 " + std::to_string(len) +
+                       ", i32 0, %String* null, %String* null }";
+  vp.init_constant("String." + index,
+                   const_value(op_type("String"), fields, false));
+#endif
+}
+
+// Create definitions for all Int constants
+void IntTable::code_int_table(std::ostream &s, CgenClassTable *ct) {
+  for (auto &[_, entry] : this->_table) {
+    entry.code_def(s, ct);
+  }
+}
+
+// generate code to define a global Int constant
+// Ints are unboxed, so this object is only used where a literal is boxed
+// (see conform), which then costs neither a call nor an allocation.
+void IntEntry::code_def(std::ostream &s, CgenClassTable *ct) {
+#ifdef LAB2
+  ValuePrinter vp(s);
+  std::string fields = "{ %_Int_vtable* @_Int_vtable_prototype, i32 " +
+                       get_string() + " }";
+  vp.init_constant("Int." + std::to_string(get_index()),
+                   const_value(op_type("Int"), fields, false));
 #endif
 }
 
@@ -577,42 +730,271 @@ void CgenNode::setup(int tag, int depth) {
   this->tag = tag;
 #ifdef LAB2
   layout_features();
-    ValuePrinter vp(*ct_stream);
-  // TODO: add code here
-  if(this->parentnd->basic() == false){
-      this->attr__ret_types.push_back(this->parentnd->get_type_name()+"*");
+#endif
+}
+
+#ifdef LAB2
+// Laying out the features gives every attribute a field after the vtable
+// pointer and every method a vtable slot. Both extend the parent's layout,
+// which setup_classes has already computed.
+void CgenNode::layout_features() {
+  if (parentnd) {
+    attr_types = parentnd->attr_types;
+    method_slots = parentnd->method_slots;
+  }
+  for (auto feature : features) {
+    feature->layout_feature(this);
+  }
+
+  // The fields of the basic classes are those of their structs in coolrt.h
+  if (name == Int) {
+    attr_types.push_back(op_type(INT32));
+  } else if (name == Bool) {
+    attr_types.push_back(op_type(INT1));
+  } else if (name == String) {
+    attr_types.push_back(op_type(INT8_PTR));
+    attr_types.push_back(op_type(INT32)); // len
+    attr_types.push_back(op_type(INT32)); // cap or start
+    attr_types.push_back(op_type("String", 1));
+    attr_types.push_back(op_type("String", 1));
+  }
+}
+
+// Define the object and vtable types of this class. The vtable header is
+// laid out as in coolrt.h: tag, object size, size class, name and the
+// type_name() String. Every method slot holds the function objects of this
+// class run for it.
+void CgenNode::code_types() {
+  ValuePrinter vp(*ct_stream);
+  std::vector<op_type> fields;
+  fields.push_back(op_type(get_vtable_type_name(), 1));
+  fields.insert(fields.end(), attr_types.begin(), attr_types.end());
+  vp.type_define(get_type_name(), fields);
+
+  std::vector<op_type> vt_type;
+  vt_type.push_back(op_type(INT32));
+  vt_type.push_back(op_type(INT32));
+  vt_type.push_back(op_type(INT32));
+  vt_type.push_back(op_type(INT8_PTR));
+  vt_type.push_back(op_type("String", 1));
+  for (auto slot : method_slots) {
+    CgenNode *owner;
+    method_class *method = find_method(slot, owner);
+    vt_type.push_back(owner->get_method_type(method));
   }
+  vp.type_define(get_vtable_type_name(), vt_type);
+}
+
+// Define the vtable prototype, which every object of this class points to
+void CgenNode::code_vtable() {
+  ValuePrinter vp(*ct_stream);
+  std::vector<op_type> vt_type;
+  std::vector<const_value> vt_val;
+  std::string self_ptr = "%" + get_type_name() + "*";
+  vt_type.push_back(op_type(INT32));
+  vt_val.push_back(const_value(op_type(INT32), std::to_string(tag), false));
+  std::string size = "ptrtoint (" + self_ptr + " getelementptr (%" +
+                     get_type_name() + ", " + self_ptr + " null, i32 1) to i32)";
+  vt_type.push_back(op_type(INT32));
+  vt_val.push_back(const_value(op_type(INT32), size, false));
+  // size class: the runtime's block size in 8 byte units, which adds an
+  // 8 byte header and rounds up, so (size + 15) >> 3
+  vt_type.push_back(op_type(INT32));
+  vt_val.push_back(const_value(op_type(INT32),
+                               "lshr (i32 add (i32 " + size +
+                                   ", i32 15), i32 3)",
+                               false));
+  op_arr_type name_type(INT8, get_type_name().size() + 1);
+  vt_type.push_back(op_type(INT8_PTR));
+  vt_val.push_back(const_value(op_type(INT8_PTR),
+                               "getelementptr (" + name_type.get_name() + ", " +
+                                   name_type.get_name() + "* @" +
+                                   get_name_bytes_name() + ", i32 0, i32 0)",
+                               false));
+  vt_type.push_back(op_type("String", 1));
+  vt_val.push_back(const_value(op_type("String", 1),
+                               "@" + get_type_name_string_name(), false));
+
+  for (auto slot : method_slots) {
+    CgenNode *owner;
+    method_class *method = find_method(slot, owner);
+    op_func_type fn_type = owner->get_method_type(method);
+    vt_type.push_back(fn_type);
+    vt_val.push_back(const_value(fn_type,
+                                 "@" + owner->get_type_name() + "_" +
+                                     slot->get_string(),
+                                 false));
+  }
+
+  vp.init_struct_constant(
+      global_value(op_type(get_vtable_type_name()), get_vtable_name()), vt_type,
+      vt_val);
+}
+
+// The type of the function this class defines for method: self and the
+// formals take their declared class's type, Int and Bool ones unboxed
+op_func_type CgenNode::get_method_type(method_class *method) {
+  return op_func_type(type_identifier(method->get_return_type()),
+                      get_method_arg_types(method));
+}
 
-  //inheritance
-  if(basic_status == basic()){
+std::vector<op_type> CgenNode::get_method_arg_types(method_class *method) {
+  std::vector<op_type> arg_types;
+  arg_types.push_back(type_identifier(SELF_TYPE));
+  Formals formals = method->get_formals();
+  for (int i = formals->first(); formals->more(i); i = formals->next(i)) {
+    arg_types.push_back(type_identifier(formals->nth(i)->get_type_decl()));
+  }
+  return arg_types;
+}
 
+// Constant folding and algebraic simplification of the typed AST
+void CgenNode::fold_features() {
+  for (auto feature : features) {
+    if (method_class *method = dynamic_cast<method_class *>(feature)) {
+      method->fold_body();
+    } else if (attr_class *attr = dynamic_cast<attr_class *>(feature)) {
+      attr->fold_init();
+    }
   }
-  else{
-    //TODO: handle inheritance
+}
+
+// Emit the pointer map the collector uses to trace objects of this class:
+// the byte offsets of every object-valued attribute, ending with -1.
+// Attribute fields follow the vtable pointer, inherited attributes first.
+void CgenNode::code_ptrmap() {
+  if (basic()) {
+    return;
   }
-  for(int i = 0; i < this->nvtable_op_types.size(); i++){
-    vt_type.push_back(this->nvtable_op_types.at(i));
+  std::vector<CgenNode *> chain;
+  for (CgenNode *c = this; c && !c->basic(); c = c->parentnd) {
+    chain.insert(chain.begin(), c);
   }
-  for(int i = 0; i < this->nvtable_const_values.size(); i++){
-      vt_val.push_back(this->nvtable_const_values.at(i));
-//TODO: finish
+
+  std::string self_ptr = "%" + get_type_name() + "*";
+  std::string offsets = "[";
+  int field = 1;
+  for (auto c : chain) {
+    for (auto feature : c->features) {
+      attr_class *attr = dynamic_cast<attr_class *>(feature);
+      if (!attr) {
+        continue;
+      }
+      Symbol type = attr->get_type_decl();
+      if (type != Int && type != Bool) {
+        op_type field_type(type == SELF_TYPE ? c->get_type_name()
+                                             : type->get_string(),
+                           2);
+        offsets += "i32 ptrtoint (" + field_type.get_name() +
+                   " getelementptr (%" + get_type_name() + ", " + self_ptr +
+                   " null, i32 0, i32 " + std::to_string(field) +
+                   ") to i32), ";
+        ptrmap_size++;
+      }
+      field++;
+    }
   }
+  offsets += "i32 -1]";
+  ptrmap_size++;
 
+  ValuePrinter vp(*ct_stream);
+  vp.init_constant(get_ptrmap_name(),
+                   const_value(op_arr_type(INT32, ptrmap_size), offsets, false));
+}
 
+// type_name() hands out this constant instead of allocating a String; it
+// is laid out like the literals from StringEntry::code_def.
+void CgenNode::code_type_name() {
+  ValuePrinter vp(*ct_stream);
+  std::string name = get_type_name();
+  op_arr_type bytes_type(INT8, name.size() + 1);
+  vp.init_constant(get_name_bytes_name(), const_value(bytes_type, name, true));
+
+  std::string bytes = "getelementptr (" + bytes_type.get_name() + ", " +
+                      bytes_type.get_name() + "* @" + get_name_bytes_name() +
+                      ", i32 0, i32 0)";
+  std::string fields = "{ %_String_vtable* @_String_vtable_prototype, i8* " +
+                       bytes + ", i32 " + std::to_string(name.size()) +
+                       ", i32 0, %String* null, %String* null }";
+  vp.init_constant(get_type_name_string_name(),
+                   const_value(op_type("String"), fields, false));
+}
+
+// Attribute fields are numbered the same way as in code_ptrmap.
+int CgenNode::get_attr_index(Symbol name, op_type &type) {
+  std::vector<CgenNode *> chain;
+  for (CgenNode *c = this; c && !c->basic(); c = c->parentnd) {
+    chain.insert(chain.begin(), c);
+  }
 
-#endif
+  int field = 1;
+  for (auto c : chain) {
+    for (auto feature : c->features) {
+      attr_class *attr = dynamic_cast<attr_class *>(feature);
+      if (!attr) {
+        continue;
+      }
+      if (attr->get_name() == name) {
+        Symbol decl = attr->get_type_decl();
+        if (decl == Int) {
+          type = op_type(INT32);
+        } else if (decl == Bool) {
+          type = op_type(INT1);
+        } else {
+          type = op_type(decl == SELF_TYPE ? c->get_type_name()
+                                           : decl->get_string(),
+                         1);
+        }
+        return field;
+      }
+      field++;
+    }
+  }
+  assert(0 && "attribute not found");
+  return -1;
 }
 
-#ifdef LAB2
-// Laying out the features involves creating a Function for each method
-// and assigning each attribute a slot in the class structure.
-void CgenNode::layout_features() {
-  // TODO: add code here
-    for(int i = features->first(); features->more(i); i = features->next(i)) {
-        features->nth(i)->layout_feature(this);
+bool CgenNode::defines_method(Symbol name) {
+  for (auto feature : features) {
+    method_class *method = dynamic_cast<method_class *>(feature);
+    if (method && method->get_name() == name) {
+      return true;
+    }
+  }
+  return false;
+}
+
+method_class *CgenNode::find_method(Symbol name, CgenNode *&owner) {
+  for (CgenNode *c = this; c; c = c->parentnd) {
+    for (auto feature : c->features) {
+      method_class *method = dynamic_cast<method_class *>(feature);
+      if (method && method->get_name() == name) {
+        owner = c;
+        return method;
+      }
     }
+  }
+  assert(0 && "method not found");
+  return nullptr;
+}
 
+// Subclasses of a class are exactly the classes tagged after it up to its
+// max_child, since setup_classes tags the tree in depth-first order.
+bool CgenNode::is_overridden_below(Symbol name) {
+  for (int t = tag + 1; t <= max_child; t++) {
+    if (class_table->get_class_by_tag(t)->defines_method(name)) {
+      return true;
+    }
+  }
+  return false;
+}
 
+// Methods keep the slot they first got in an ancestor's vtable when they
+// are overridden; new ones are appended in declaration order.
+int CgenNode::get_method_index(Symbol name) {
+  auto slot = std::find(method_slots.begin(), method_slots.end(), name);
+  assert(slot != method_slots.end() && "method not found");
+  return slot - method_slots.begin();
 }
 
 // Class codegen. This should performed after every class has been setup.
@@ -625,30 +1007,81 @@ void CgenNode::code_class() {
   // TODO: add code here
 
   CgenEnvironment *env = new CgenEnvironment(*(this->get_classtable()->ct_stream), this);
-  ValuePrinter vp(*env->cur_stream);
+  code_init_function(env);
 
-//  //TODO: methods
-//
-//  //op_type type_ptr(this->get_type_name()+"*");
-//  std::string type_name = this->get_type_name();
-//  vp.define(type_name+"*", type_name+"new", std::vector<operand>());
-//  vp.begin_block("entry");
-//  //op_type vt_ptr(type_name+"_vtable*", type_name+"_vtable_prototype");
-//    op_type vt_ptr(type_name+"_vtable*");
-//  operand vt_operand = vp.getelementptr(vt_ptr, operand(INT32, "0"), operand(INT32, "1"), op_type(INT32_PTR));
-//  operand ld_ret = vp.load(op_type(INT8_PTR), vt_operand);
-//  std::vector<operand> ld_ret_vec;
-//  ld_ret_vec.push_back(ld_ret);
-//  operand rcall_ret = vp.call(std::vector<op_type>(INT8_PTR), op_type(INT8_PTR), "malloc", true, ld_ret_vec);
-//  operand bc_ret = vp.bitcast(rcall_ret, type_name+"*");
-//  env->set_bitcast_return(bc_ret);
-//    //operand *element_ptr = vp.getelementptr();
-//    return;
+  // every method gets an environment of its own
+  for (auto feature : features) {
+    if (method_class *method = dynamic_cast<method_class *>(feature)) {
+      CgenEnvironment method_env(*ct_stream, this);
+      method->code(&method_env);
+    }
+  }
+}
 
+// The attributes X_new has to store into, inherited ones first
+std::vector<attr_class *> CgenNode::get_init_attrs() {
+  std::vector<attr_class *> attrs;
+  for (CgenNode *c = this; c && !c->basic(); c = c->parentnd) {
+    std::vector<attr_class *> own;
+    for (auto feature : c->features) {
+      attr_class *attr = dynamic_cast<attr_class *>(feature);
+      if (attr && attr->needs_init()) {
+        own.push_back(attr);
+      }
+    }
+    attrs.insert(attrs.begin(), own.begin(), own.end());
+  }
+  return attrs;
 }
 
 void CgenNode::code_init_function(CgenEnvironment *env) {
   // TODO: add code here
+  ValuePrinter vp(*env->cur_stream);
+  op_type self_type(get_type_name(), 1);
+  vp.define(self_type, get_init_function_name(), std::vector<operand>());
+  env->begin_block("entry");
+
+  // Like a method body, this is generated into buffers, since the
+  // initializers can ask for root slots and stack storage
+  std::stringstream allocas, body;
+  std::ostream *out = env->cur_stream;
+  env->cur_stream = &body;
+  env->alloca_stream = &allocas;
+  ValuePrinter bp(body);
+
+  // Storage comes from the runtime arena, which reads the object size out of
+  // the vtable, so no malloc call is emitted here.
+  op_type obj_vtable_type("_Object_vtable", 1);
+  casted_value vtable(obj_vtable_type, "@" + get_vtable_name(),
+                      op_type(get_vtable_type_name(), 1));
+  std::vector<op_type> alloc_arg_types;
+  alloc_arg_types.push_back(obj_vtable_type);
+  std::vector<operand> alloc_args;
+  alloc_args.push_back(vtable);
+  operand obj = bp.call(alloc_arg_types, op_type("Object", 1), "Object_alloc",
+                        true, alloc_args);
+  operand new_self = bp.bitcast(obj, self_type);
+  env->set_bitcast_return(new_self);
+
+  // The attributes are initialized in order, inherited ones first. An
+  // initializer can allocate and so move the new object, which is therefore
+  // bound to self in a root slot while they run.
+  std::vector<attr_class *> attrs = get_init_attrs();
+  operand ret = new_self;
+  if (!attrs.empty()) {
+    operand self_slot = env->new_root(self_type);
+    bp.store(new_self, self_slot);
+    env->add_binding(self, &self_slot);
+    for (auto attr : attrs) {
+      attr->code(env);
+    }
+    ret = bp.load(self_type, self_slot);
+  }
+  code_return(ret, env);
+
+  env->cur_stream = out;
+  env->alloca_stream = out;
+  code_entry(allocas, body, env);
 }
 
 #else
@@ -667,7 +1100,6 @@ void CgenNode::codeGenMainmain() {
   // -- setup or create the environment, env, for translating this method
     CgenEnvironment env(*ct_stream, this);
   // -- invoke mainMethod->code(env) to translate the method
-  //mainMethod->make_alloca(&env);
   mainMethod->code(&env);
 
 
@@ -687,6 +1119,19 @@ CgenNode *CgenEnvironment::type_to_class(Symbol t) {
                         : get_class()->get_classtable()->find_in_scopes(t);
 }
 
+operand CgenEnvironment::new_alloca(op_type type) {
+  ValuePrinter vp(*alloca_stream);
+  return vp.alloca_mem(type);
+}
+
+operand CgenEnvironment::new_root(op_type type) {
+  ValuePrinter vp(*alloca_stream);
+  operand slot = vp.getelementptr(op_type("Object", 1), get_roots(),
+                                  int_value(new_root_slot()),
+                                  op_type("Object", 2));
+  return vp.bitcast(slot, type.get_ptr_type());
+}
+
 /*********************************************************************
 
   APS class methods
@@ -712,6 +1157,63 @@ void program_class::cgen(const std::optional<std::string> &outfile) {
   }
 }
 
+// Return val from a function whose body is being generated, popping its
+// shadow stack frame first if it has one
+void code_return(operand val, CgenEnvironment *env) {
+    ValuePrinter vp(*env->cur_stream);
+    if (env->get_num_roots() > 0) {
+        std::vector<op_type> pop_types;
+        pop_types.push_back(op_type("_GcFrame", 1));
+        std::vector<operand> pop_args;
+        pop_args.push_back(operand(op_type("_GcFrame", 1), "gc.frame"));
+        vp.call(*env->cur_stream, pop_types, "cool_gc_pop_frame", true, pop_args,
+                operand(VOID, ""));
+    }
+    vp.ret(val);
+}
+
+// Finish a function whose entry block has begun: push its shadow stack
+// frame, now that the number of root slots is known, and print the storage
+// and the body generated for it, followed by the error blocks the body
+// branches to
+void code_entry(std::stringstream &allocas, std::stringstream &body,
+                CgenEnvironment *env) {
+    ValuePrinter vp(*env->cur_stream);
+    std::ostream &out = *env->cur_stream;
+    int num_roots = env->get_num_roots();
+    if (num_roots > 0) {
+        operand gc_frame(op_type("_GcFrame", 1), "gc.frame");
+        vp.alloca_mem(out, op_type("_GcFrame"), gc_frame);
+        vp.alloca_mem(out, op_type("Object", 1), num_roots, env->get_roots());
+        std::vector<op_type> push_types;
+        push_types.push_back(gc_frame.get_type());
+        push_types.push_back(env->get_roots().get_type());
+        push_types.push_back(op_type(INT32));
+        std::vector<operand> push_args;
+        push_args.push_back(gc_frame);
+        push_args.push_back(env->get_roots());
+        push_args.push_back(int_value(num_roots));
+        vp.call(out, push_types, "cool_gc_push_frame", true, push_args, operand(VOID, ""));
+    }
+    out << allocas.str() << body.str();
+
+    //error handlers
+    std::vector<op_type> abort_types;
+    vp.begin_block("divByZeroError");
+    vp.call(abort_types, VOID, "abort", true, std::vector<operand>());
+    vp.unreachable();
+#ifdef LAB2
+    vp.begin_block("dispatchVoidError");
+    vp.call(abort_types, VOID, "abort", true, std::vector<operand>());
+    vp.unreachable();
+    vp.begin_block("caseError");
+    vp.call(abort_types, VOID, "abort", true, std::vector<operand>());
+    vp.unreachable();
+#endif
+
+    vp.end_define();
+}
+
 // Create a method body
 void method_class::code(CgenEnvironment *env) {
   if (cgen_debug) {
@@ -726,28 +1228,83 @@ void method_class::code(CgenEnvironment *env) {
     //std::vector<operand> args;
     std::vector<op_type> arg_types;
     //vp.define(ret, name->get_string(), args);
+#ifdef LAB2
+    // Formals and the return value take the type of their declared class:
+    // Int and Bool ones are passed unboxed
+    CgenNode *cls = env->get_class();
+    op_type ret_type = cls->type_identifier(return_type);
+    std::vector<Symbol> arg_names;
+    args.push_back(operand(op_type(cls->get_type_name(), 1), "self"));
+    arg_names.push_back(self);
+    for (int i = formals->first(); formals->more(i); i = formals->next(i)) {
+        Formal formal = formals->nth(i);
+        args.push_back(operand(cls->type_identifier(formal->get_type_decl()),
+                               formal->get_name()->get_string()));
+        arg_names.push_back(formal->get_name());
+    }
+    // A method nothing overrides is the target of every devirtualized call
+    // to it, so it is worth inlining there
+    vp.define(ret_type, cls->get_type_name() + "_" + name->get_string(), args,
+              cls->is_overridden_below(name) ? "" : "inlinehint");
+#else
     vp.define(INT32, "Main_main", args);
+#endif
 
     //entry block
-    vp.begin_block("entry");
+    env->begin_block("entry");
+
+#ifdef LAB2
+    // Marks the `new` expressions whose objects can live in this frame; the
+    // summary is forced first so that recursive calls are settled
+    method_captures(cls, this);
+    EscapeState escapes(cls);
+    escape_analysis(this, escapes);
+#endif
 
-    //recurse for alloca statements at the beginning
-    std::cerr <<std::endl << "beginning alloca sweep" << std::endl;
-    expr->make_alloca(env);
-    env->reset_counters();
+    // The body is generated in a single walk into a buffer, and the storage
+    // it asks for into another. Both are printed into the entry block once
+    // the walk is done and the number of root slots is known.
+    std::stringstream allocas, body;
+    std::ostream *out = env->cur_stream;
+    env->cur_stream = &body;
+    env->alloca_stream = &allocas;
+    ValuePrinter bp(body);
+
+#ifdef LAB2
+    // Object arguments, self included, get root slots like object lets do
+    std::vector<operand> arg_slots;
+    arg_slots.reserve(args.size());
+    for (size_t i = 0; i < args.size(); i++) {
+        op_type arg_type = args[i].get_type();
+        if (arg_type.get_id() == OBJ_PTR) {
+            arg_slots.push_back(env->new_root(arg_type));
+        } else if (!escapes.var_assigned(i)) {
+            // self and the formals are variables 0..n of escape analysis
+            arg_slots.push_back(args[i]);
+            env->add_binding(arg_names[i], &arg_slots.back());
+            continue;
+        } else {
+            arg_slots.push_back(env->new_alloca(arg_type));
+        }
+        bp.store(args[i], arg_slots.back());
+        env->add_binding(arg_names[i], &arg_slots.back());
+    }
+#endif
 
     //recurse through code
-    std::cerr <<std::endl << "beginning recursive cgen" << std::endl;
+    if (cgen_debug) {
+        std::cerr << "beginning recursive cgen" << std::endl;
+    }
     operand retreg = expr->code(env);
+#ifdef LAB2
+    retreg = conform(retreg, ret_type, env);
+#endif
 
-    vp.ret(retreg);
-
-    //error handlers
-    vp.begin_block("divByZeroError");
-    vp.call( arg_types, VOID, "abort", true, args);
-    vp.ret(int_value(0));
+    code_return(retreg, env);
 
-    vp.end_define();
+    env->cur_stream = out;
+    env->alloca_stream = out;
+    code_entry(allocas, body, env);
 }
 
 // Codegen for expressions. Note that each expression has a value.
@@ -757,26 +1314,20 @@ operand assign_class::code(CgenEnvironment *env) {
     std::cerr << "assign" << std::endl;
 
   ValuePrinter vp(*env->cur_stream);
-  // TODO: add code here and replace `return operand()`
   operand assignVal = expr->code(env);
-  std::basic_string<char> retName = env->new_name();
-//  operand ptr(assignVal.get_type().get_ptr_type(), ptrName);
-//  operand retPtr(assignVal.get_type().get_ptr_type(), name->get_string());
-  operand target(assignVal.get_type().get_ptr_type(), env->new_assign_label(name->get_string(), true));
-  operand ret(assignVal.get_type(), retName);
-//  std::basic_string<char> retName = env->new_name();
-//  operand ptr(assignVal.get_type(), retName);
-//  operand ret(assignVal.get_type(), retName);
-//
-//  //vp.getelementptr( assignVal.get_type(), assignVal, global_value(ptr), assignVal.get_type().get_ptr_type());
-//  vp.load(*env->cur_stream, assignVal.get_type().get_ptr_type(), ptr, ret);
-  operand *target1 = env->find_in_scopes(name);
-
-  vp.store(*env->cur_stream, assignVal, *target1);
-    //vp.getelementptr()
-
-
+  operand *target = env->find_in_scopes(name);
+  if (target == NULL) {
+    // not a local, so it names an attribute of self
+    code_attr_store(name, assignVal, env);
+    return assignVal;
+  }
 
+#ifdef LAB2
+  vp.store(conform(assignVal, target->get_type().get_deref_type(), env),
+           *target);
+#else
+  vp.store(*env->cur_stream, assignVal, *target);
+#endif
   return assignVal;
 }
 
@@ -784,86 +1335,67 @@ operand cond_class::code(CgenEnvironment *env) {
   if (cgen_debug)
     std::cerr << "cond" << std::endl;
 
-  // TODO: add code here and replace `return operand()`
   ValuePrinter vp(*env->cur_stream);
 
   operand predVal = pred->code(env);
-  operand compTrue = bool_const(true)->code(env);
-  operand compResult(INT1, env->new_name());
   std::string thenLabel = env->new_then_label();
   std::string elseLabel = env->new_else_label();
   std::string fiLabel = env->new_fi_label();
+#ifdef LAB2
+  op_type ret_type = env->get_class()->type_identifier(type);
+#else
+  op_type ret_type(type == Bool ? INT1 : INT32);
+#endif
 
-  //setting up the return operand
-    op_type ret_type(VOID);
-    std::string retPtrName = env->new_if_temp_var();
-    std::string retName = env->new_name();
-    if(type == Int){
-        ret_type.set_type(INT32);
-    }
-    else if(type == Bool){
-        ret_type.set_type(INT1);
-    }
-    operand retPtr(ret_type.get_ptr_type(), retPtrName);
-    operand ret(ret_type, retName);
-
-  //evaluate predicate
-  vp.icmp(*env->cur_stream, EQ, predVal, compTrue, compResult);
-  vp.branch_cond(compResult, thenLabel, elseLabel);
+  vp.branch_cond(predVal, thenLabel, elseLabel);
 
-  //then block
-  vp.begin_block(thenLabel);
+  // Each arm may end in a different block than it began, so the phi names
+  // the block each value was computed in
+  env->begin_block(thenLabel);
   operand thenVal = then_exp->code(env);
-  vp.store(thenVal, retPtr);
+#ifdef LAB2
+  thenVal = conform(thenVal, ret_type, env);
+#endif
+  label thenEnd = env->current_block();
   vp.branch_uncond(fiLabel);
 
-  //else block
-  vp.begin_block(elseLabel);
+  env->begin_block(elseLabel);
   operand elseVal = else_exp->code(env);
-  vp.store(elseVal, retPtr);
+#ifdef LAB2
+  elseVal = conform(elseVal, ret_type, env);
+#endif
+  label elseEnd = env->current_block();
   vp.branch_uncond(fiLabel);
 
-  //fi block
-  vp.begin_block(fiLabel);
-  vp.load(*env->cur_stream, ret_type, retPtr, ret);
-
-  return ret;
+  env->begin_block(fiLabel);
+  return vp.phi({thenVal, elseVal}, {thenEnd, elseEnd});
 }
 
 operand loop_class::code(CgenEnvironment *env) {
   if (cgen_debug)
     std::cerr << "loop" << std::endl;
 
-  // TODO: add code here and replace `return operand()`
   ValuePrinter vp(*env->cur_stream);
   std::string condLabel = env->new_loop_condition_label();
   std::string bodyLabel = env->new_loop_body_label();
   std::string poolLabel = env->new_pool_label();
-//  operand predVal = pred->code(env);
-//  operand compTrue = bool_const(true)->code(env);
-//  operand compResult(INT1, env->new_name());
-
 
   vp.branch_uncond(condLabel);
   //loop condition check, jump to body or pool
-  vp.begin_block(condLabel);
+  env->begin_block(condLabel);
   operand predVal = pred->code(env);
-  operand compTrue = bool_const(true)->code(env);
-  operand compResult(INT1, env->new_name());
-  //vp.icmp(*env->cur_stream, EQ, predVal, compTrue, compResult);
-//  vp.branch_cond(compResult, bodyLabel, poolLabel);
-    vp.branch_cond(predVal, bodyLabel, poolLabel);
+  vp.branch_cond(predVal, bodyLabel, poolLabel);
 
   //loop body, jump to condition check
-  vp.begin_block(bodyLabel);
-  operand bodyVal = body->code(env);
+  env->begin_block(bodyLabel);
+  body->code(env);
   vp.branch_uncond(condLabel);
 
   //pool
-  vp.begin_block(poolLabel);
-  //vp.ret(bodyVal);
+  env->begin_block(poolLabel);
 
-  return bodyVal;
+  // a loop evaluates to void
+  return null_value(op_type("Object", 1));
 }
 
 operand block_class::code(CgenEnvironment *env) {
@@ -887,36 +1419,27 @@ operand let_class::code(CgenEnvironment *env) {
   if (cgen_debug)
     std::cerr << "let" << std::endl;
 
-  // TODO: add code here and replace `return operand()`
   ValuePrinter vp(*env->cur_stream);
-  operand initVal = init->code(env);
-  //TODO: two bugs to fix: naming and non-assignment lets
-  operand target(VOID, env->new_label(identifier->get_string(), true));
-  //operand target(VOID, "i0");
-  if(type_decl == Int){
-      //operand target(INT32_PTR, identifier->get_string());
-      target.set_type(INT32_PTR);
-  }
-  else if(type_decl == Bool){
-      //operand target(INT1_PTR, identifier->get_string());
-      target.set_type(INT1_PTR);
-  }
-
-  //store the constant into a reg
-  //vp.init_constant(env->new_name(), initVal);
-  //store that reg to
-  //op_type voidType((op_type_id)VOID);
-  operand isVoid(EMPTY, env->new_name());
-  if(initVal.get_type().get_id() == isVoid.get_type().get_id()) {
-    if(type_decl == Int){
-        vp.store(*env->cur_stream, const_value(INT32, "0", false), target);
-    }
-    else if(type_decl == Bool){
-        vp.store(*env->cur_stream, const_value(INT1, "false", false), target);
-    }
+  op_type id_type = env->get_class()->type_identifier(type_decl);
+  operand value = init->code(env);
+  if (value.get_type().get_id() == EMPTY) {
+    value = default_value(type_decl, id_type);
   }
-  else{
-      vp.store(*env->cur_stream, initVal, target);
+#ifdef LAB2
+  value = conform(value, id_type, env);
+#endif
+
+  // An Int or Bool let that is never assigned is bound to its value, so
+  // uses of it read the register directly. Other Int and Bool ones get a
+  // stack slot, and object references a root slot so the collector can see
+  // them.
+  operand target = value;
+  if (id_type.get_id() == OBJ_PTR) {
+    target = env->new_root(id_type);
+    vp.store(value, target);
+  } else if (reassigned) {
+    target = env->new_alloca(id_type);
+    vp.store(value, target);
   }
 
   env->open_scope();
@@ -984,6 +1507,12 @@ operand divide_class::code(CgenEnvironment *env) {
   operand RHS = e2->code(env);
   operand ret(INT32, env->new_name());
 
+  // a nonzero constant divisor, found by fold, cannot fail
+  if (nonzero_divisor) {
+    vp.div(*env->cur_stream, LHS, RHS, ret);
+    return ret;
+  }
+
   //should check for divide by zero error
   operand errorCheck(INT1, env->new_name());
     int_value zero = 0;
@@ -993,7 +1522,7 @@ operand divide_class::code(CgenEnvironment *env) {
   vp.icmp(*env->cur_stream, NE, RHS, zero, errorCheck);
   vp.branch_cond(errorCheck, passLabel, "divByZeroError");
 
-  vp.begin_block(passLabel);
+  env->begin_block(passLabel);
   vp.div(*env->cur_stream, LHS, RHS, ret);
 
   return ret;
@@ -1038,9 +1567,42 @@ operand eq_class::code(CgenEnvironment *env) {
   // TODO: add code here and replace `return operand()`
     ValuePrinter vp(*env->cur_stream);
     operand LHS = e1->code(env);
+#ifdef LAB2
+    // An object waits in a root slot while e2 runs, which can move it
+    operand lhs_slot;
+    if (LHS.get_type().get_id() == OBJ_PTR) {
+        lhs_slot = env->new_root(LHS.get_type());
+        vp.store(LHS, lhs_slot);
+    }
+    operand RHS = e2->code(env);
+    if (!lhs_slot.is_empty()) {
+        LHS = vp.load(LHS.get_type(), lhs_slot);
+    }
+#else
     operand RHS = e2->code(env);
+#endif
     operand ret(INT1, env->new_name());
 
+    // Strings compare by content; a lazily concatenated one has no bytes
+    // to compare until the runtime flattens it
+    if (LHS.get_type().is_string_object()) {
+        std::vector<op_type> eq_types;
+        eq_types.push_back(LHS.get_type());
+        eq_types.push_back(RHS.get_type());
+        std::vector<operand> eq_args;
+        eq_args.push_back(LHS);
+        eq_args.push_back(RHS);
+        vp.call(*env->cur_stream, eq_types, "String_equal", true, eq_args, ret);
+        return ret;
+    }
+    // other objects are the same when they are the same object, whatever
+    // their static classes
+    if (LHS.get_type().get_id() == OBJ_PTR &&
+        !LHS.get_type().is_same_with(RHS.get_type())) {
+        LHS = vp.bitcast(LHS, op_type("Object", 1));
+        RHS = vp.bitcast(RHS, op_type("Object", 1));
+    }
+
     vp.icmp(*env->cur_stream, EQ, LHS, RHS, ret);
 
     return ret;
@@ -1116,6 +1678,26 @@ operand object_class::code(CgenEnvironment *env) {
     std::cerr << "Object" << std::endl;
     ValuePrinter vp(*env->cur_stream);
 
+    // lets, formals and self are slots, except Int and Bool ones that are
+    // never assigned, which are bound to the value itself
+    operand *slot = env->find_in_scopes(name);
+    if (slot != NULL) {
+        op_type_id id = slot->get_type().get_id();
+        if (id == INT32 || id == INT1) {
+            return *slot;
+        }
+        return vp.load(slot->get_type().get_deref_type(), *slot);
+    }
+#ifdef LAB2
+    if (name == self) {
+        return env->bc_return; // in X_new, before self is bound
+    }
+    return code_attr_load(name, env);
+#else
+    assert(0 && "Unbound identifier");
+    return operand();
+#endif
+
 //  // TODO: add code here and replace `return operand()`
 //  ValuePrinter vp(*env->cur_stream);
 //  op_type p = VOID;
@@ -1163,7 +1745,12 @@ operand static_dispatch_class::code(CgenEnvironment *env) {
   assert(0 && "Unsupported case for phase 1");
 #else
   // TODO: add code here and replace `return operand()`
-  return operand();
+  CgenNode *owner;
+  method_class *method = env->type_to_class(type_name)->find_method(name, owner);
+  std::vector<operand> vals = code_dispatch_operands(
+      expr, actual, owner->get_method_arg_types(method), env);
+  operand ret = code_method_call(owner, method, vals, operand(), env);
+  return conform(ret, env->get_class()->type_identifier(type), env);
 #endif
 }
 
@@ -1174,7 +1761,9 @@ operand string_const_class::code(CgenEnvironment *env) {
   assert(0 && "Unsupported case for phase 1");
 #else
   // TODO: add code here and replace `return operand()`
-  return operand();
+  // literals are the constant String objects emitted by StringEntry::code_def
+  return global_value(op_type("String", 1),
+                      "String." + std::to_string(token->get_index()));
 #endif
 }
 
@@ -1185,7 +1774,23 @@ operand dispatch_class::code(CgenEnvironment *env) {
   assert(0 && "Unsupported case for phase 1");
 #else
   // TODO: add code here and replace `return operand()`
-  return operand();
+  ValuePrinter vp(*env->cur_stream);
+  CgenNode *recv_class = env->type_to_class(expr->get_type());
+  CgenNode *owner;
+  method_class *method = recv_class->find_method(name, owner);
+  std::vector<operand> vals = code_dispatch_operands(
+      expr, actual, owner->get_method_arg_types(method), env);
+
+  // Class hierarchy analysis: if no subclass of the receiver's static class
+  // redefines the method, every receiver runs owner's definition, and the
+  // call is direct
+  operand ret;
+  if (!recv_class->is_overridden_below(name)) {
+    ret = code_method_call(owner, method, vals, operand(), env);
+  } else {
+    ret = code_cached_dispatch(recv_class, name, vals, env);
+  }
+  return conform(ret, env->get_class()->type_identifier(type), env);
 #endif
 }
 
@@ -1197,7 +1802,45 @@ operand typcase_class::code(CgenEnvironment *env) {
   assert(0 && "Unsupported case for phase 1");
 #else
   // TODO: add code here and replace `return operand()`
-  return operand();
+  ValuePrinter vp(*env->cur_stream);
+  std::string prefix = env->new_label("case.", true);
+  operand expr_val = expr->code(env);
+  CgenNode *cls = env->type_to_class(expr->get_type());
+
+  // case on void is a runtime error; unboxed Ints and Bools are never void
+  if (expr_val.get_type().get_id() == OBJ_PTR) {
+    operand is_void = vp.icmp(EQ, expr_val, null_value(expr_val.get_type()));
+    vp.branch_cond(is_void, "caseError", prefix + ".tag");
+    env->begin_block(prefix + ".tag");
+  }
+  operand tag = get_class_tag(expr_val, cls, env);
+
+  // The result is stored at the end of a branch and loaded right after,
+  // with nothing allocating in between, so it needs no root slot
+  op_type alloca_type = env->get_class()->type_identifier(type);
+  operand alloca_op = env->new_alloca(alloca_type);
+
+  std::vector<label> targets;
+  for (int i = cases->first(); cases->more(i); i = cases->next(i)) {
+    targets.push_back(prefix + ".br" + std::to_string(i));
+  }
+  std::vector<std::pair<int, int>> runs = case_runs(cls, cases);
+  code_case_select(tag, cls, runs, targets, prefix, env);
+
+  // Only branches some tag selects are emitted
+  for (int i = cases->first(); cases->more(i); i = cases->next(i)) {
+    if (std::none_of(runs.begin(), runs.end(),
+                     [i](std::pair<int, int> run) { return run.second == i; })) {
+      continue;
+    }
+    env->begin_block(targets[i]);
+    operand val = cases->nth(i)->code(expr_val, tag, alloca_type, env);
+    vp.store(val, alloca_op);
+    vp.branch_uncond(prefix + ".exit");
+  }
+
+  env->begin_block(prefix + ".exit");
+  return vp.load(alloca_type, alloca_op);
 #endif
 }
 
@@ -1209,14 +1852,53 @@ operand new__class::code(CgenEnvironment *env) {
   assert(0 && "Unsupported case for phase 1");
 #else
   // TODO: add code here and replace `return operand()`
-  operand class_(op_type("unkown"), env->get_class()->get_type_name()+"*");
-  std::vector<op_type> types_blk;
-  types_blk.push_back(op_type());
-  std::vector<operand> args;
-    args.push_back(operand());
-  vp.call(*env->cur_stream, types_blk, env->get_class()->get_type_name()+"_new", false, args, class_);
-  env->add_binding(type_name, &class_);
-  //return operand();
+  // Int and Bool are unboxed, so a new one is just the default value
+  if (type_name == Int) {
+    return int_value(0);
+  }
+  if (type_name == Bool) {
+    return bool_value(false, true);
+  }
+
+  CgenNode *cls = env->type_to_class(type_name);
+  op_type obj_type(cls->get_type_name(), 1);
+  if (type_name == SELF_TYPE) {
+    // the class of self is only known at run time, so its X_new is looked
+    // up by tag in the table code_new_table emits
+    operand *self_slot = env->find_in_scopes(self);
+    operand recv = self_slot != NULL
+                       ? vp.load(self_slot->get_type().get_deref_type(),
+                                 *self_slot)
+                       : env->bc_return;
+    operand tag = get_class_tag(recv, cls, env);
+    op_arr_type table_type(INT8_PTR, cls->get_classtable()->get_num_classes());
+    operand entry = vp.getelementptr(
+        table_type, global_value(table_type.get_ptr_type(), "_new_table"),
+        int_value(0), tag, op_type(INT8_PPTR));
+    op_func_type init_type(op_type("Object", 1), std::vector<op_type>());
+    operand init = vp.bitcast(vp.load(op_type(INT8_PTR), entry), init_type);
+    operand obj = vp.call(std::vector<op_type>(), op_type("Object", 1),
+                          init.get_name().substr(1), false,
+                          std::vector<operand>());
+    return vp.bitcast(obj, obj_type);
+  }
+
+  if (on_stack) {
+    // Escape analysis found that the object dies with this frame. Its
+    // storage is reused each time this expression runs, so clear it the
+    // way Object_alloc clears heap blocks before setting the vtable.
+    operand stack_slot = env->new_alloca(op_type(cls->get_type_name()));
+    vp.store(const_value(op_type(cls->get_type_name()), "zeroinitializer",
+                         false),
+             stack_slot);
+    operand vtblptr = vp.bitcast(stack_slot, op_type(INT8_PPTR));
+    vp.store(casted_value(op_type(INT8_PTR), "@" + cls->get_vtable_name(),
+                          op_type(cls->get_vtable_type_name(), 1)),
+             vtblptr);
+    return stack_slot;
+  }
+  return vp.call(std::vector<op_type>(), obj_type,
+                 cls->get_init_function_name(), true, std::vector<operand>());
 #endif
 }
 
@@ -1227,80 +1909,42 @@ operand isvoid_class::code(CgenEnvironment *env) {
   assert(0 && "Unsupported case for phase 1");
 #else
   // TODO: add code here and replace `return operand()`
-  return operand();
+  ValuePrinter vp(*env->cur_stream);
+  operand val = e1->code(env);
+  // unboxed Ints and Bools are never void
+  if (val.get_type().get_id() != OBJ_PTR) {
+    return bool_value(false, true);
+  }
+  return vp.icmp(EQ, val, null_value(val.get_type()));
 #endif
 }
 
 
+// The LLVM type of a value whose static type is exactly type. Int and Bool
+// values stay unboxed in every slot, field, formal and return value of that
+// type; conform boxes them only where they flow into another class.
 op_type CgenNode::type_identifier(Symbol type){
-    op_type optype_type = EMPTY;
     if(type == Int){
-        optype_type = INT32;
+        return op_type(INT32);
     }
     else if(type == Bool){
-        optype_type = INT1;
-    }
-    else if(type == String){
-        optype_type = INT8_PTR;
+        return op_type(INT1);
     }
     else if(type == SELF_TYPE){
-        optype_type = this->get_type_name();
+        return op_type(this->get_type_name(), 1);
     }
-    else{
-        optype_type = this->get_type_name() + "*";
-    }
-    return optype_type;
-}
-
-bool is_built_in_class_question_mark(std::string name){
-    if(name != "Object" && name != "Bool" && name != "Int" && name != "String" && name != "IO"){
-        return true;
-    }
-    else return false;
+    return op_type(type->get_string(), 1);
 }
 
-
-// Create the LLVM Function corresponding to this method.
+// Give this method a vtable slot, unless it overrides one it inherited
 void method_class::layout_feature(CgenNode *cls) {
 #ifndef LAB2
   assert(0 && "Unsupported case for phase 1");
 #else
-
-  // TODO: add code here
-  CgenEnvironment* env = new CgenEnvironment(*(cls->get_classtable()->ct_stream), cls);
-  //std::string type = cls->get_type_name();
-  cls->attribute_list.push_back(this->name);
-  cls->attribute_type_list.push_back(this->return_type);
-  std::string vtable_ptr_feature = cls->get_type_name()+"_"+name->get_string();
-  Symbol type = this->name;
-  op_type optype_type = cls->type_identifier(type);
-  operand self(optype_type, type->get_string());
-
-  std::vector<op_type> formals;
-  //operand
-  formals.push_back(optype_type);
-  cls->formal_operand_list.push_back(self);
-
-  for(int i = this->formals->first(); this->formals->more(i); this->formals->next(i)){
-      optype_type = cls->type_identifier(this->formals->nth(i)->get_type_decl());
-      formals.push_back(optype_type);
-      operand self_temp(optype_type, this->formals->nth(i)->get_name()->get_string());
-      cls->formal_operand_list.push_back(self_temp);
-  }
-
-  //create the actual vtable
-  if(is_built_in_class_question_mark(cls->get_type_name())){
-      op_type feature(cls->type_identifier(return_type));
-      op_func_type feature_func_type(feature, formals);
-      cls->nvtable_op_types.push_back(feature_func_type);
-      cls->nvtable_reutenr_list.push_back(return_type->get_string());
-      global_value vtable_ptr_feature_GLOBAL(op_type(vtable_ptr_feature), vtable_ptr_feature);
-      const_value vtable_ptr_feature_CONST(op_type(vtable_ptr_feature), vtable_ptr_feature_GLOBAL.get_name(), false);
-      cls->nvtable_const_values.push_back(vtable_ptr_feature_CONST);
-
+  std::vector<Symbol> &slots = cls->method_slots;
+  if (std::find(slots.begin(), slots.end(), name) == slots.end()) {
+    slots.push_back(name);
   }
-
-
 #endif
 }
 
@@ -1309,13 +1953,27 @@ void method_class::layout_feature(CgenNode *cls) {
 // and <= (max child of the branch class) tag,
 // then the branch is a superclass of the source.
 // See the LAB2 handout for more information about our use of class tags.
+// Handle one branch of a Cool case expression. The tag has already been
+// matched to this branch, so this binds the variable and evaluates the body.
 operand branch_class::code(operand expr_val, operand tag, op_type join_type,
                            CgenEnvironment *env) {
 #ifndef LAB2
   assert(0 && "Unsupported case for phase 1");
 #else
   // TODO: add code here and replace `return operand()`
-  return operand();
+  // The variable is bound like a let: Int and Bool ones get a stack slot,
+  // and object references a root slot
+  ValuePrinter vp(*env->cur_stream);
+  op_type alloca_type = env->get_class()->type_identifier(type_decl);
+  operand alloca_op = alloca_type.get_id() == OBJ_PTR
+                          ? env->new_root(alloca_type)
+                          : env->new_alloca(alloca_type);
+  vp.store(conform(expr_val, alloca_type, env), alloca_op);
+  env->open_scope();
+  env->add_binding(name, &alloca_op);
+  operand val = conform(expr->code(env), join_type, env);
+  env->close_scope();
+  return val;
 #endif
 }
 
@@ -1324,316 +1982,483 @@ void attr_class::layout_feature(CgenNode *cls) {
 #ifndef LAB2
   assert(0 && "Unsupported case for phase 1");
 #else
-  // TODO: add code here
-  CgenEnvironment* env = new CgenEnvironment(*(cls->get_classtable()->ct_stream), cls);
-  std::string type_decl_str = type_decl->get_string();
-
-  if(type_decl_str != "Object" && type_decl_str != "IO" && type_decl_str != "String" && type_decl_str != "Main" && type_decl_str != "SELF_TYPE"){
-      if(type_decl_str == "Int" || type_decl_str == "int"){
-          cls->attr__ret_types.push_back(op_type(INT32));
-      }
-      else if(type_decl_str == "Bool" || type_decl_str == "bool"){
-          cls->attr__ret_types.push_back(op_type(INT1));
-      }
-      else if(type_decl_str == "sbyte*"){
-          cls->attr__ret_types.push_back(op_type(INT8_PTR));
-      }
-      else{
-          op_type type(type_decl_str+"*");
-          cls->attr__ret_types.push_back(type);
-      }
-
+  // the basic classes' fields are set in CgenNode::layout_features
+  if (!cls->basic()) {
+    cls->attr_types.push_back(cls->type_identifier(type_decl));
   }
-
 #endif
 }
 
+// Object_alloc zeroes every field, which is the default value of every type
+// but String
+bool attr_class::needs_init() {
+  return type_decl == String || !dynamic_cast<no_expr_class *>(init);
+}
+
 void attr_class::code(CgenEnvironment *env) {
 #ifndef LAB2
   assert(0 && "Unsupported case for phase 1");
 #else
   // TODO: add code here
-  ValuePrinter vp(*env->cur_stream);
-  //if metholy
-  //else
   operand attribute_temp_result(init->code(env));
-  operand *self_lookup(env->find_in_scopes(self));
-  op_type attribute_type(env->get_class()->get_type_name()+"*");
-  op_type expression_type(attribute_temp_result.get_type().get_ptr_type());
-    operand attribute_op(attribute_type, env->bc_return.get_name().substr(0, env->bc_return.get_name().length()-1));
-  //why the fuck won't you take the god damn arguments they match the signature!!!!!!!!
-    //operand aret = vp.getelementptr(attribute_op, int_value(0), int_value(1), expression_type);
-    //vp.store(*env->cur_stream, attribute_temp_result, aret);
-
-
+  if (attribute_temp_result.get_type().get_id() == EMPTY) {
+    attribute_temp_result =
+        default_value(type_decl, env->get_class()->type_identifier(type_decl));
+  }
+  code_attr_store(name, attribute_temp_result, env);
 #endif
 }
 
 /*
- * Definitions of make_alloca
+ * Definitions of escape
+ *
+ * escape(state, escapes) walks an expression whose value escapes the method
+ * if escapes is set: it is returned, stored to an attribute, or handed to a
+ * method that may keep it. A value bound to a variable escapes if any use of
+ * the variable does.
  */
-void assign_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "assign" << std::endl;
+void assign_class::escape(EscapeState *state, bool escapes) {
+  // A value assigned to a variable declared outside the innermost loop may
+  // outlive the iteration that created it, and the next iteration would
+  // reuse its frame storage
+  int var = state->lookup(name);
+  if (var >= 0) {
+    state->mark_assigned(var);
+  }
+  bool kept = var < 0 || state->var_escapes(var) ||
+              state->var_depth(var) < state->loop_depth;
+  expr->escape(state, escapes || kept);
+}
 
-  // TODO: add code here
+void cond_class::escape(EscapeState *state, bool escapes) {
+  pred->escape(state, false);
+  then_exp->escape(state, escapes);
+  else_exp->escape(state, escapes);
+}
 
-  expr->make_alloca(env);
+void loop_class::escape(EscapeState *state, bool escapes) {
+  state->loop_depth++;
+  pred->escape(state, false);
+  body->escape(state, false);
+  state->loop_depth--;
 }
 
-void cond_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "cond" << std::endl;
-
-  // TODO: add code here
-  ValuePrinter vp(*env->cur_stream);
-  op_type ret_type(VOID);
-  if(type == Int){
-      ret_type.set_type(INT32);
+void block_class::escape(EscapeState *state, bool escapes) {
+  for (int i = body->first(); body->more(i); i = body->next(i)) {
+    body->nth(i)->escape(state, body->more(body->next(i)) ? false : escapes);
   }
-  else if(type == Bool){
-      ret_type.set_type(INT1);
-  }
-  operand retPtr(ret_type.get_ptr_type(), env->new_if_temp_var());
-
-  vp.alloca_mem(*env->cur_stream, ret_type, retPtr);
-
-  pred->make_alloca(env);
-  then_exp->make_alloca(env);
-  else_exp->make_alloca(env);
 }
 
-void loop_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "loop" << std::endl;
-
-  // TODO: add code here
+void let_class::escape(EscapeState *state, bool escapes) {
+  int var = state->new_var();
+  init->escape(state, state->var_escapes(var));
+  state->bind(identifier, var);
+  body->escape(state, escapes);
+  state->unbind();
+  reassigned = state->var_assigned(var);
+}
 
-  pred->make_alloca(env);
-  body->make_alloca(env);
+void plus_class::escape(EscapeState *state, bool escapes) {
+  e1->escape(state, false);
+  e2->escape(state, false);
 }
 
-void block_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "block" << std::endl;
+void sub_class::escape(EscapeState *state, bool escapes) {
+  e1->escape(state, false);
+  e2->escape(state, false);
+}
 
-  // TODO: add code here
-  for(int i = 0; i < body->len(); i++){
-      body->nth(i)->make_alloca(env);
-  }
+void mul_class::escape(EscapeState *state, bool escapes) {
+  e1->escape(state, false);
+  e2->escape(state, false);
 }
 
-void let_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "let" << std::endl;
+void divide_class::escape(EscapeState *state, bool escapes) {
+  e1->escape(state, false);
+  e2->escape(state, false);
+}
 
-  // TODO: add code here
-  ValuePrinter vp(*env->cur_stream);
-  op_type type(type_decl->get_string());
-  operand op2(type, env->new_label(identifier->get_string(), true));
-  if(type_decl == Int){
-      vp.alloca_mem(*env->cur_stream, INT32, op2);
-  }
-  else if(type_decl == Bool){
-      vp.alloca_mem(*env->cur_stream, INT1, op2);
-  }
+void neg_class::escape(EscapeState *state, bool escapes) {
+  e1->escape(state, false);
+}
 
-  //vp.alloca_mem(*env->cur_stream, type, op2);
+void lt_class::escape(EscapeState *state, bool escapes) {
+  e1->escape(state, false);
+  e2->escape(state, false);
+}
 
-  init->make_alloca(env);
-  body->make_alloca(env);
+void eq_class::escape(EscapeState *state, bool escapes) {
+  e1->escape(state, false);
+  e2->escape(state, false);
 }
 
-void plus_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "plus" << std::endl;
+void leq_class::escape(EscapeState *state, bool escapes) {
+  e1->escape(state, false);
+  e2->escape(state, false);
+}
 
-  // TODO: add code here
-  e1->make_alloca(env);
-  e2->make_alloca(env);
+void comp_class::escape(EscapeState *state, bool escapes) {
+  e1->escape(state, false);
 }
 
-void sub_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "sub" << std::endl;
+void int_const_class::escape(EscapeState *state, bool escapes) {}
 
-  // TODO: add code here
-    e1->make_alloca(env);
-    e2->make_alloca(env);
-}
+void bool_const_class::escape(EscapeState *state, bool escapes) {}
 
-void mul_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "mul" << std::endl;
+void string_const_class::escape(EscapeState *state, bool escapes) {}
 
-  // TODO: add code here
-    e1->make_alloca(env);
-    e2->make_alloca(env);
+void no_expr_class::escape(EscapeState *state, bool escapes) {}
+
+void object_class::escape(EscapeState *state, bool escapes) {
+  int var = state->lookup(name);
+  if (escapes && var >= 0) {
+    state->mark_escaping(var);
+  }
 }
 
-void divide_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "div" << std::endl;
+void isvoid_class::escape(EscapeState *state, bool escapes) {
+  e1->escape(state, false);
+}
 
-  // TODO: add code here
-    e1->make_alloca(env);
-    e2->make_alloca(env);
+void static_dispatch_class::escape(EscapeState *state, bool escapes) {
+#ifdef LAB2
+  std::vector<bool> captures = dispatch_captures(
+      state->cls->get_classtable()->find_in_scopes(type_name), name, true);
+  expr->escape(state, captures[0]);
+  for (int i = actual->first(); actual->more(i); i = actual->next(i)) {
+    actual->nth(i)->escape(state, captures[i + 1]);
+  }
+#endif
 }
 
-void neg_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "neg" << std::endl;
+void dispatch_class::escape(EscapeState *state, bool escapes) {
+#ifdef LAB2
+  Symbol recv_type = expr->get_type();
+  CgenNode *recv_class =
+      recv_type == SELF_TYPE
+          ? state->cls
+          : state->cls->get_classtable()->find_in_scopes(recv_type);
+  std::vector<bool> captures = dispatch_captures(recv_class, name, false);
+  expr->escape(state, captures[0]);
+  for (int i = actual->first(); actual->more(i); i = actual->next(i)) {
+    actual->nth(i)->escape(state, captures[i + 1]);
+  }
+#endif
+}
 
-  // TODO: add code here
-    e1->make_alloca(env);
+void typcase_class::escape(EscapeState *state, bool escapes) {
+  // the branch variables are not followed, so the scrutinee is kept
+  expr->escape(state, true);
+  for (int i = cases->first(); cases->more(i); i = cases->next(i)) {
+    cases->nth(i)->escape(state, escapes);
+  }
 }
 
-void lt_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "lt" << std::endl;
+void branch_class::escape(EscapeState *state, bool escapes) {
+  state->bind(name, state->new_var());
+  expr->escape(state, escapes);
+  state->unbind();
+}
 
-  // TODO: add code here
-  ValuePrinter vp(*env->cur_stream);
-  //op_type boolType = op_type_id (INT1);
-    //operand retPtr(boolType.get_ptr_type(), env->new_if_temp_var());
+void new__class::escape(EscapeState *state, bool escapes) {
+#ifdef LAB2
+  // Only classes cgen lays out can live in a frame, and only those whose
+  // fields all start out zeroed, since the initializers run in X_new;
+  // SELF_TYPE has no static size
+  CgenNode *cls =
+      type_name == SELF_TYPE
+          ? nullptr
+          : state->cls->get_classtable()->find_in_scopes(type_name);
+  on_stack = !escapes && cls && !cls->basic() && cls->get_init_attrs().empty();
+#endif
+}
 
-    //vp.alloca_mem(*env->cur_stream, boolType, retPtr);
+/*
+ * Definitions of fold
+ *
+ * fold() simplifies an expression of the typed AST and returns what should
+ * replace it, which is the expression itself or one with the same static
+ * type. Int arithmetic wraps at 32 bits like the code generated for it.
+ */
+static bool int_const_value(Expression e, int &value) {
+  int_const_class *c = dynamic_cast<int_const_class *>(e);
+  if (c == NULL) {
+    return false;
+  }
+  value = (int)(uint32_t)std::stoll(c->get_token()->get_string());
+  return true;
+}
 
-    e1->make_alloca(env);
-    e2->make_alloca(env);
+static bool bool_const_value(Expression e, bool &value) {
+  bool_const_class *c = dynamic_cast<bool_const_class *>(e);
+  if (c == NULL) {
+    return false;
+  }
+  value = c->get_val();
+  return true;
 }
 
-void eq_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "eq" << std::endl;
+static Expression fold_int(int value) {
+  return int_const(inttable.add_string(std::to_string(value)))->set_type(Int);
+}
 
-  // TODO: add code here
-    e1->make_alloca(env);
-    e2->make_alloca(env);
+static Expression fold_bool(bool value) {
+  return bool_const(value)->set_type(Bool);
 }
 
-void leq_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "leq" << std::endl;
+static Expressions fold_list(Expressions list) {
+  Expressions folded = nil_Expressions();
+  for (int i = list->first(); list->more(i); i = list->next(i)) {
+    folded = append_Expressions(folded, single_Expressions(list->nth(i)->fold()));
+  }
+  return folded;
+}
 
-  // TODO: add code here
-    e1->make_alloca(env);
-    e2->make_alloca(env);
+// Whether dropping e loses nothing but its value
+static bool side_effect_free(Expression e) {
+  return dynamic_cast<object_class *>(e) || dynamic_cast<int_const_class *>(e) ||
+         dynamic_cast<bool_const_class *>(e) ||
+         dynamic_cast<string_const_class *>(e);
 }
 
-void comp_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "complement" << std::endl;
+Expression assign_class::fold() {
+  expr = expr->fold();
+  return this;
+}
 
-  // TODO: add code here
-    e1->make_alloca(env);
-    //e2->make_alloca(env);
+// A constant predicate leaves one arm, which replaces the cond when it has
+// the cond's type; otherwise the cond is kept to convert it.
+Expression cond_class::fold() {
+  pred = pred->fold();
+  then_exp = then_exp->fold();
+  else_exp = else_exp->fold();
+  bool taken;
+  if (bool_const_value(pred, taken)) {
+    Expression arm = taken ? then_exp : else_exp;
+    if (arm->get_type() == type) {
+      return arm;
+    }
+  }
+  return this;
 }
 
-void int_const_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "Integer Constant" << std::endl;
+Expression loop_class::fold() {
+  pred = pred->fold();
+  body = body->fold();
+  return this;
+}
 
-  // TODO: add code here
+Expression typcase_class::fold() {
+  expr = expr->fold();
+  for (int i = cases->first(); cases->more(i); i = cases->next(i)) {
+    cases->nth(i)->fold();
+  }
+  return this;
 }
 
-void bool_const_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "Boolean Constant" << std::endl;
+void branch_class::fold() { expr = expr->fold(); }
 
-  // TODO: add code here
+// Values computed only to be discarded are dropped
+Expression block_class::fold() {
+  Expressions kept = nil_Expressions();
+  for (int i = body->first(); body->more(i); i = body->next(i)) {
+    Expression e = body->nth(i)->fold();
+    if (body->more(body->next(i)) && side_effect_free(e)) {
+      continue;
+    }
+    kept = append_Expressions(kept, single_Expressions(e));
+  }
+  body = kept;
+  return body->len() == 1 ? body->nth(body->first()) : this;
 }
 
-void object_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "Object" << std::endl;
+Expression let_class::fold() {
+  init = init->fold();
+  body = body->fold();
+  return this;
+}
 
-  // TODO: add code here
+Expression plus_class::fold() {
+  e1 = e1->fold();
+  e2 = e2->fold();
+  int a, b;
+  bool a_const = int_const_value(e1, a), b_const = int_const_value(e2, b);
+  if (a_const && b_const) {
+    return fold_int((int)((uint32_t)a + (uint32_t)b));
+  }
+  if (a_const && a == 0) {
+    return e2;
+  }
+  if (b_const && b == 0) {
+    return e1;
+  }
+  return this;
 }
 
-void no_expr_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "No_expr" << std::endl;
+Expression sub_class::fold() {
+  e1 = e1->fold();
+  e2 = e2->fold();
+  int a, b;
+  bool a_const = int_const_value(e1, a), b_const = int_const_value(e2, b);
+  if (a_const && b_const) {
+    return fold_int((int)((uint32_t)a - (uint32_t)b));
+  }
+  if (b_const && b == 0) {
+    return e1;
+  }
+  return this;
+}
 
-  // TODO: add code here
+Expression mul_class::fold() {
+  e1 = e1->fold();
+  e2 = e2->fold();
+  int a, b;
+  bool a_const = int_const_value(e1, a), b_const = int_const_value(e2, b);
+  if (a_const && b_const) {
+    return fold_int((int)((uint32_t)a * (uint32_t)b));
+  }
+  if ((a_const && a == 0 && side_effect_free(e2)) ||
+      (b_const && b == 0 && side_effect_free(e1))) {
+    return fold_int(0);
+  }
+  if (a_const && a == 1) {
+    return e2;
+  }
+  if (b_const && b == 1) {
+    return e1;
+  }
+  return this;
+}
+
+// Division by zero is left to fail at run time. A nonzero constant divisor
+// needs no check. Dividing by -1 negates, wrapping like ~, so INT_MIN / -1 is
+// INT_MIN rather than an sdiv that overflows.
+Expression divide_class::fold() {
+  e1 = e1->fold();
+  e2 = e2->fold();
+  int a, b;
+  bool a_const = int_const_value(e1, a), b_const = int_const_value(e2, b);
+  if (!b_const || b == 0) {
+    return this;
+  }
+  if (b == -1) {
+    return a_const ? fold_int((int)(0 - (uint32_t)a))
+                   : neg(e1)->set_type(Int);
+  }
+  if (a_const) {
+    return fold_int(a / b);
+  }
+  if (b == 1) {
+    return e1;
+  }
+  nonzero_divisor = true;
+  return this;
 }
 
-void static_dispatch_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "static dispatch" << std::endl;
-#ifndef LAB2
-  assert(0 && "Unsupported case for phase 1");
-#else
-    // TODO: add code here
-#endif
+Expression neg_class::fold() {
+  e1 = e1->fold();
+  int a;
+  if (int_const_value(e1, a)) {
+    return fold_int((int)(0 - (uint32_t)a));
+  }
+  neg_class *inner = dynamic_cast<neg_class *>(e1);
+  if (inner != NULL) {
+    return inner->e1;
+  }
+  return this;
 }
 
-void string_const_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "string_const" << std::endl;
-#ifndef LAB2
-  assert(0 && "Unsupported case for phase 1");
-#else
-    // TODO: add code here
-#endif
+Expression lt_class::fold() {
+  e1 = e1->fold();
+  e2 = e2->fold();
+  int a, b;
+  if (int_const_value(e1, a) && int_const_value(e2, b)) {
+    return fold_bool(a < b);
+  }
+  return this;
 }
 
-void dispatch_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "dispatch" << std::endl;
-#ifndef LAB2
-  assert(0 && "Unsupported case for phase 1");
-#else
-    // TODO: add code here
-#endif
+// Only Int and Bool constants are compared here; objects compare by
+// identity and Strings by content at run time
+Expression eq_class::fold() {
+  e1 = e1->fold();
+  e2 = e2->fold();
+  int a, b;
+  if (int_const_value(e1, a) && int_const_value(e2, b)) {
+    return fold_bool(a == b);
+  }
+  bool p, q;
+  if (bool_const_value(e1, p) && bool_const_value(e2, q)) {
+    return fold_bool(p == q);
+  }
+  return this;
 }
 
-void typcase_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "typecase::make_alloca()" << std::endl;
-#ifndef LAB2
-  assert(0 && "Unsupported case for phase 1");
-#else
-    // TODO: add code here
-#endif
+Expression leq_class::fold() {
+  e1 = e1->fold();
+  e2 = e2->fold();
+  int a, b;
+  if (int_const_value(e1, a) && int_const_value(e2, b)) {
+    return fold_bool(a <= b);
+  }
+  return this;
 }
 
-void new__class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "newClass" << std::endl;
-#ifndef LAB2
-  assert(0 && "Unsupported case for phase 1");
-#else
-    // TODO: add code here
-#endif
+Expression comp_class::fold() {
+  e1 = e1->fold();
+  bool p;
+  if (bool_const_value(e1, p)) {
+    return fold_bool(!p);
+  }
+  comp_class *inner = dynamic_cast<comp_class *>(e1);
+  if (inner != NULL) {
+    return inner->e1;
+  }
+  return this;
 }
 
-void isvoid_class::make_alloca(CgenEnvironment *env) {
-  if (cgen_debug)
-    std::cerr << "isvoid" << std::endl;
-#ifndef LAB2
-  assert(0 && "Unsupported case for phase 1");
-#else
-    // TODO: add code here
-#endif
+Expression int_const_class::fold() { return this; }
+
+Expression bool_const_class::fold() { return this; }
+
+Expression string_const_class::fold() { return this; }
+
+Expression new__class::fold() { return this; }
+
+Expression isvoid_class::fold() {
+  e1 = e1->fold();
+  return this;
 }
 
-void branch_class::make_alloca(CgenEnvironment *env) {
-#ifndef LAB2
-  assert(0 && "Unsupported case for phase 1");
-#else
-  // TODO: add code here
-#endif
+Expression no_expr_class::fold() { return this; }
+
+Expression object_class::fold() { return this; }
+
+Expression static_dispatch_class::fold() {
+  expr = expr->fold();
+  actual = fold_list(actual);
+  return this;
 }
 
-void method_class::make_alloca(CgenEnvironment *env) { return; }
+Expression dispatch_class::fold() {
+  expr = expr->fold();
+  actual = fold_list(actual);
+  return this;
+}
 
-void attr_class::make_alloca(CgenEnvironment *env) {
-#ifndef LAB2
-  assert(0 && "Unsupported case for phase 1");
-#else
-  // TODO: add code here
-#endif
+// The value a variable or attribute declared with type, of LLVM type
+// id_type, starts out with: 0, false, the empty String or void
+operand default_value(Symbol type, op_type id_type) {
+  if (type == Int) {
+    return int_value(0);
+  } else if (type == Bool) {
+    return bool_value(false, true);
+  } else if (type == String) {
+    Symbol empty = stringtable.lookup_string("");
+    return global_value(op_type("String", 1),
+                        "String." + std::to_string(empty->get_index()));
+  }
+  return null_value(id_type);
 }
 
 #ifdef LAB2
@@ -1643,7 +2468,479 @@ void attr_class::make_alloca(CgenEnvironment *env) {
 // It should only be called when this condition holds.
 // (It's needed by the supplied code for typecase)
 operand conform(operand src, op_type type, CgenEnvironment *env) {
-  // TODO: add code here
-  return operand();
+  ValuePrinter vp(*env->cur_stream);
+  op_type src_type = src.get_type();
+  if (src_type.is_same_with(type)) {
+    return src;
+  }
+
+  // Boxing: an Int literal is the constant object IntEntry::code_def
+  // emitted for it. Otherwise the runtime hands out shared objects for small
+  // Ints and for both Bools, and only allocates outside that range.
+  if (src_type.get_id() == INT32 || src_type.get_id() == INT1) {
+    bool is_int = src_type.get_id() == INT32;
+    Symbol literal = is_int && src.get_name()[0] != '%'
+                         ? inttable.lookup_string(src.get_name())
+                         : nullptr;
+    if (literal != nullptr) {
+      return conform(global_value(op_type("Int", 1),
+                                  "Int." + std::to_string(literal->get_index())),
+                     type, env);
+    }
+    std::vector<op_type> box_types;
+    box_types.push_back(src_type);
+    std::vector<operand> box_args;
+    box_args.push_back(src);
+    operand boxed = vp.call(box_types, op_type(is_int ? "Int" : "Bool", 1),
+                            is_int ? "Int_box" : "Bool_box", true, box_args);
+    return conform(boxed, type, env);
+  }
+
+  // Unboxing: load the val field
+  if (type.get_id() == INT32 || type.get_id() == INT1) {
+    op_type box_type(type.get_id() == INT32 ? "Int" : "Bool", 1);
+    operand box = conform(src, box_type, env);
+    operand field = vp.getelementptr(box_type.get_deref_type(), box,
+                                     int_value(0), int_value(1),
+                                     type.get_ptr_type());
+    return vp.load(type, field);
+  }
+
+  return vp.bitcast(src, type);
+}
+
+// Load attribute name of self. Int and Bool fields are unboxed, like their
+// slots, so the value is returned as is.
+operand code_attr_load(Symbol name, CgenEnvironment *env) {
+  ValuePrinter vp(*env->cur_stream);
+  operand obj = env->bc_return;
+  operand *self_slot = env->find_in_scopes(self);
+  if (self_slot != NULL) {
+    obj = vp.load(self_slot->get_type().get_deref_type(), *self_slot);
+  }
+
+  op_type field_type;
+  int index = env->get_class()->get_attr_index(name, field_type);
+  operand field = vp.getelementptr(obj.get_type().get_deref_type(), obj,
+                                   int_value(0), int_value(index),
+                                   field_type.get_ptr_type());
+  return vp.load(field_type, field);
+}
+
+// Attributes live in the object, so a reference stored there must be
+// reported to the collector: the nursery is only collected from the roots
+// and from the old objects the write barrier has remembered.
+void code_attr_store(Symbol name, operand val, CgenEnvironment *env) {
+  ValuePrinter vp(*env->cur_stream);
+  CgenNode *cls = env->get_class();
+
+  // Boxing can allocate, so it comes before self is loaded
+  op_type field_type;
+  int index = cls->get_attr_index(name, field_type);
+  val = conform(val, field_type, env);
+
+  // self lives in a root slot once it is bound; in X_new it is the new object
+  operand obj = env->bc_return;
+  operand *self_slot = env->find_in_scopes(self);
+  if (self_slot != NULL) {
+    obj = vp.load(self_slot->get_type().get_deref_type(), *self_slot);
+  }
+
+  operand field = vp.getelementptr(obj.get_type().get_deref_type(), obj,
+                                   int_value(0), int_value(index),
+                                   field_type.get_ptr_type());
+  vp.store(val, field);
+
+  if (field_type.get_id() == OBJ_PTR) {
+    std::vector<op_type> barrier_types;
+    barrier_types.push_back(op_type("Object", 1));
+    barrier_types.push_back(op_type(INT8_PTR));
+    std::vector<operand> barrier_args;
+    barrier_args.push_back(vp.bitcast(obj, op_type("Object", 1)));
+    barrier_args.push_back(vp.bitcast(val, op_type(INT8_PTR)));
+    vp.call(*env->cur_stream, barrier_types, "cool_gc_write_barrier", true,
+            barrier_args, operand(VOID, ""));
+  }
+}
+
+// Evaluate the arguments of a dispatch and then its receiver, in Cool's
+// order, and return the receiver followed by the arguments, converted to
+// arg_types, the types of self and the formals of the method called.
+// Objects wait in the dispatch's root slots while the rest are evaluated,
+// since that can allocate and move them, and are reloaded once all are done.
+// Boxing allocates too, so an unboxed value is boxed before it waits, and
+// an unboxed receiver before the arguments are reloaded.
+std::vector<operand> code_dispatch_operands(Expression recv, Expressions actual,
+                                            std::vector<op_type> arg_types,
+                                            CgenEnvironment *env) {
+  ValuePrinter vp(*env->cur_stream);
+  std::vector<operand> vals;
+  std::vector<operand> slots;
+  auto park = [&](operand val, int root) {
+    operand slot;
+    if (val.get_type().get_id() == OBJ_PTR) {
+      slot = vp.getelementptr(op_type("Object", 1), env->get_roots(),
+                              int_value(root), op_type("Object", 2));
+      vp.store(vp.bitcast(val, op_type("Object", 1)), slot);
+    }
+    vals.push_back(val);
+    slots.push_back(slot);
+  };
+
+  // taken before the arguments are generated, so that dispatches nested in
+  // them get slots of their own
+  int root = env->get_num_roots();
+  for (int i = actual->first(); actual->more(i); i = actual->next(i)) {
+    env->new_root_slot();
+  }
+  for (int i = actual->first(); actual->more(i); i = actual->next(i)) {
+    park(conform(actual->nth(i)->code(env), arg_types[vals.size() + 1], env),
+         root++);
+  }
+  operand self_val = conform(recv->code(env), arg_types[0], env);
+  vals.insert(vals.begin(), self_val);
+  slots.insert(slots.begin(), operand());
+
+  for (size_t i = 1; i < vals.size(); i++) {
+    if (!slots[i].is_empty()) {
+      vals[i] = vp.bitcast(vp.load(op_type("Object", 1), slots[i]),
+                           vals[i].get_type());
+    }
+  }
+  // dispatch on void is a runtime error; self is never void
+  object_class *recv_object = dynamic_cast<object_class *>(recv);
+  if (recv_object && recv_object->get_name() == self) {
+    return vals;
+  }
+  operand is_void = vp.icmp(EQ, self_val, null_value(self_val.get_type()));
+  std::string ok_label = env->new_ok_label();
+  vp.branch_cond(is_void, "dispatchVoidError", ok_label);
+  env->begin_block(ok_label);
+  return vals;
+}
+
+// The vtable header (tag, size, size class, name and type_name String)
+// takes four words; the methods follow, one word each.
+#define VTABLE_HEADER_WORDS 4
+
+// Load the vtable pointer of recv, as an i8*
+operand code_vtblptr(operand recv, CgenEnvironment *env) {
+  ValuePrinter vp(*env->cur_stream);
+  return vp.load(op_type(INT8_PTR), vp.bitcast(recv, op_type(INT8_PPTR)));
+}
+
+// Load the code for method name from the vtable of a recv_class object
+operand code_vtable_load(CgenNode *recv_class, operand vtblptr, Symbol name,
+                         CgenEnvironment *env) {
+  ValuePrinter vp(*env->cur_stream);
+  operand vtable = vp.bitcast(vtblptr, op_type(INT8_PPTR));
+  operand slot = vp.getelementptr(
+      op_type(INT8_PTR), vtable,
+      int_value(VTABLE_HEADER_WORDS + recv_class->get_method_index(name)),
+      op_type(INT8_PPTR));
+  return vp.load(op_type(INT8_PTR), slot);
+}
+
+// Call method, defined in owner, with the receiver and arguments in vals.
+// fn is the code loaded from a vtable, or empty for a direct call.
+operand code_method_call(CgenNode *owner, method_class *method,
+                         std::vector<operand> vals, operand fn,
+                         CgenEnvironment *env) {
+  ValuePrinter vp(*env->cur_stream);
+  std::vector<op_type> arg_types = owner->get_method_arg_types(method);
+  std::vector<operand> args;
+  for (size_t i = 0; i < vals.size(); i++) {
+    args.push_back(conform(vals[i], arg_types[i], env));
+  }
+  op_type ret_type = owner->type_identifier(method->get_return_type());
+
+  if (fn.is_empty()) {
+    return vp.call(arg_types, ret_type,
+                   owner->get_type_name() + "_" +
+                       method->get_name()->get_string(),
+                   true, args);
+  }
+  op_func_type fn_type(ret_type, arg_types);
+  operand code = vp.bitcast(fn, fn_type); // op_func_type is a pointer
+  return vp.call(arg_types, ret_type, code.get_name().substr(1), false, args);
+}
+
+// Receiver classes counted at dispatches, read from the file named by
+// CGEN_DISPATCH_PROFILE. Each line is "Static.method Receiver count", where
+// Static is the receiver's static class; counts are kept highest first.
+static std::map<std::string, std::vector<std::pair<int, std::string>>> &
+dispatch_profile() {
+  static std::map<std::string, std::vector<std::pair<int, std::string>>> profile;
+  static bool loaded = false;
+  if (!loaded) {
+    loaded = true;
+    const char *path = getenv("CGEN_DISPATCH_PROFILE");
+    std::ifstream in(path ? path : "");
+    std::string site, receiver;
+    int count;
+    while (in >> site >> receiver >> count) {
+      profile[site].push_back(std::make_pair(count, receiver));
+    }
+    for (auto &[_, receivers] : profile) {
+      std::sort(receivers.rbegin(), receivers.rend());
+    }
+  }
+  return profile;
+}
+
+#define MAX_INLINE_CACHE 2
+
+// The classes a dynamic dispatch of name guards for, most likely first: the
+// ones the profile saw most, or else the static class and, when a single
+// subclass redefines the method, that subclass
+std::vector<CgenNode *> likely_receivers(CgenNode *recv_class, Symbol name) {
+  CgenClassTable *ct = recv_class->get_classtable();
+  std::vector<CgenNode *> likely;
+  std::string site = recv_class->get_type_name() + "." + name->get_string();
+  auto seen = dispatch_profile().find(site);
+  if (seen != dispatch_profile().end()) {
+    for (auto &[_, receiver] : seen->second) {
+      for (int t = recv_class->get_tag(); t <= recv_class->get_max_child(); t++) {
+        if (ct->get_class_by_tag(t)->get_type_name() == receiver &&
+            likely.size() < MAX_INLINE_CACHE) {
+          likely.push_back(ct->get_class_by_tag(t));
+        }
+      }
+    }
+    return likely;
+  }
+
+  likely.push_back(recv_class);
+  std::vector<CgenNode *> overriders;
+  for (int t = recv_class->get_tag() + 1; t <= recv_class->get_max_child(); t++) {
+    if (ct->get_class_by_tag(t)->defines_method(name)) {
+      overriders.push_back(ct->get_class_by_tag(t));
+    }
+  }
+  if (overriders.size() == 1) {
+    likely.push_back(overriders[0]);
+  }
+  return likely;
+}
+
+// A dispatch that stays dynamic gets an inline cache: the receiver's vtable
+// pointer is compared with those of the likely classes, and a match calls
+// that class's method directly, where LLVM can inline it. Any other
+// receiver calls through its vtable.
+operand code_cached_dispatch(CgenNode *recv_class, Symbol name,
+                             std::vector<operand> vals, CgenEnvironment *env) {
+  ValuePrinter vp(*env->cur_stream);
+  CgenNode *owner;
+  method_class *method = recv_class->find_method(name, owner);
+  op_type ret_type = owner->type_identifier(method->get_return_type());
+  operand vtblptr = code_vtblptr(vals[0], env);
+
+  std::vector<CgenNode *> likely = likely_receivers(recv_class, name);
+  std::string ic = env->new_label("ic.", true);
+  std::vector<operand> results;
+  std::vector<label> preds;
+  for (size_t i = 0; i < likely.size(); i++) {
+    std::string hit = ic + ".hit" + std::to_string(i);
+    std::string miss = ic + ".miss" + std::to_string(i);
+    casted_value expected(op_type(INT8_PTR), "@" + likely[i]->get_vtable_name(),
+                          op_type(likely[i]->get_vtable_type_name(), 1));
+    vp.branch_cond(vp.icmp(EQ, vtblptr, expected), hit, miss);
+
+    env->begin_block(hit);
+    CgenNode *target;
+    method_class *target_method = likely[i]->find_method(name, target);
+    operand ret = code_method_call(target, target_method, vals, operand(), env);
+    results.push_back(conform(ret, ret_type, env));
+    preds.push_back(hit);
+    vp.branch_uncond(ic + ".done");
+    env->begin_block(miss);
+  }
+
+  operand fn = code_vtable_load(recv_class, vtblptr, name, env);
+  operand ret = code_method_call(owner, method, vals, fn, env);
+  if (likely.empty()) {
+    return ret;
+  }
+  results.push_back(ret);
+  preds.push_back(ic + ".miss" + std::to_string(likely.size() - 1));
+  vp.branch_uncond(ic + ".done");
+  env->begin_block(ic + ".done");
+  return vp.phi(results, preds);
+}
+
+// The dynamic class tag of src, whose static class is src_cls. Unboxed Ints
+// and Bools have exactly their static class.
+operand get_class_tag(operand src, CgenNode *src_cls, CgenEnvironment *env) {
+  ValuePrinter vp(*env->cur_stream);
+  if (src.get_type().get_id() != OBJ_PTR) {
+    return int_value(src_cls->get_tag());
+  }
+  // the tag is the first word of the vtable header
+  operand vtblptr = code_vtblptr(src, env);
+  return vp.load(op_type(INT32), vp.bitcast(vtblptr, op_type(INT32_PTR)));
+}
+
+// A case can only see subclasses of its scrutinee's static class cls, whose
+// tags are cls's tag up to its max_child. Each of them runs the branch for
+// its closest ancestor among the branch types, the matching branch with the
+// greatest tag, or none (-1). setup_classes tags the tree depth first, so
+// each branch owns contiguous runs of tags; a run is listed as its first tag
+// and the branch.
+std::vector<std::pair<int, int>> case_runs(CgenNode *cls, Cases cases) {
+  CgenClassTable *table = cls->get_classtable();
+  std::vector<std::pair<int, int>> runs;
+  for (int t = cls->get_tag(); t <= cls->get_max_child(); t++) {
+    int branch = -1, branch_tag = -1;
+    for (int i = cases->first(); cases->more(i); i = cases->next(i)) {
+      CgenNode *branch_cls =
+          table->find_in_scopes(cases->nth(i)->get_type_decl());
+      if (branch_cls->get_tag() <= t && t <= branch_cls->get_max_child() &&
+          branch_cls->get_tag() > branch_tag) {
+        branch = i;
+        branch_tag = branch_cls->get_tag();
+      }
+    }
+    if (runs.empty() || runs.back().second != branch) {
+      runs.push_back({t, branch});
+    }
+  }
+  return runs;
+}
+
+// A subtree of at most this many classes is selected with one switch over
+// its tags; a larger one with a balanced tree of range comparisons
+#define MAX_CASE_SWITCH 16
+
+static label case_target(std::pair<int, int> run,
+                         const std::vector<label> &targets) {
+  return run.second < 0 ? "caseError" : targets[run.second];
+}
+
+// Branch to the target of the run containing tag, among runs[lo..hi], by
+// binary search on the runs' first tags: O(log n) comparisons.
+static void code_case_tree(operand tag,
+                           const std::vector<std::pair<int, int>> &runs,
+                           int lo, int hi, const std::vector<label> &targets,
+                           const std::string &prefix, CgenEnvironment *env) {
+  ValuePrinter vp(*env->cur_stream);
+  int mid = (lo + hi + 1) / 2;
+  label below = lo == mid - 1 ? case_target(runs[lo], targets)
+                              : prefix + ".lt" + std::to_string(mid);
+  label above = mid == hi ? case_target(runs[hi], targets)
+                          : prefix + ".ge" + std::to_string(mid);
+  vp.branch_cond(vp.icmp(LT, tag, int_value(runs[mid].first)), below, above);
+  if (lo < mid - 1) {
+    env->begin_block(below);
+    code_case_tree(tag, runs, lo, mid - 1, targets, prefix, env);
+  }
+  if (mid < hi) {
+    env->begin_block(above);
+    code_case_tree(tag, runs, mid, hi, targets, prefix, env);
+  }
+}
+
+void code_case_select(operand tag, CgenNode *cls,
+                      const std::vector<std::pair<int, int>> &runs,
+                      const std::vector<label> &targets,
+                      const std::string &prefix, CgenEnvironment *env) {
+  ValuePrinter vp(*env->cur_stream);
+  if (runs.size() == 1) {
+    vp.branch_uncond(case_target(runs[0], targets));
+    return;
+  }
+  if (cls->get_max_child() - cls->get_tag() + 1 > MAX_CASE_SWITCH) {
+    code_case_tree(tag, runs, 0, runs.size() - 1, targets, prefix, env);
+    return;
+  }
+
+  std::vector<const_value> vals;
+  std::vector<label> labels;
+  for (size_t r = 0; r < runs.size(); r++) {
+    if (runs[r].second < 0) {
+      continue;
+    }
+    int end = r + 1 < runs.size() ? runs[r + 1].first : cls->get_max_child() + 1;
+    for (int t = runs[r].first; t < end; t++) {
+      vals.push_back(int_value(t));
+      labels.push_back(targets[runs[r].second]);
+    }
+  }
+  vp.switch_inst(tag, "caseError", vals, labels);
+}
+
+// The runtime's methods keep self only where they return it (IO's out_string
+// and out_int), except that a String built by concat or substr points at the
+// Strings it came from.
+static std::vector<bool> basic_method_captures(CgenNode *owner,
+                                               method_class *method) {
+  std::vector<bool> captures(1 + method->get_formals()->len(), false);
+  bool is_string = owner->get_type_name() == "String";
+  captures[0] = is_string || (method->get_return_type() == SELF_TYPE &&
+                              method->get_name() != cool_copy);
+  for (size_t i = 1; i < captures.size(); i++) {
+    captures[i] = is_string;
+  }
+  return captures;
+}
+
+std::vector<bool> method_captures(CgenNode *owner, method_class *method) {
+  static std::map<method_class *, std::vector<bool>> summaries;
+  auto found = summaries.find(method);
+  if (found != summaries.end()) {
+    return found->second;
+  }
+  if (owner->basic()) {
+    return summaries[method] = basic_method_captures(owner, method);
+  }
+
+  // A recursive call seen while the summary is being computed keeps
+  // everything
+  summaries[method] =
+      std::vector<bool>(1 + method->get_formals()->len(), true);
+  EscapeState state(owner);
+  escape_analysis(method, state);
+  std::vector<bool> captures;
+  for (int var = 0; var <= method->get_formals()->len(); var++) {
+    captures.push_back(state.var_escapes(var));
+  }
+  return summaries[method] = captures;
+}
+
+std::vector<bool> dispatch_captures(CgenNode *recv_class, Symbol name,
+                                    bool is_static) {
+  CgenNode *owner;
+  method_class *method = recv_class->find_method(name, owner);
+  std::vector<bool> captures = method_captures(owner, method);
+  if (is_static) {
+    return captures;
+  }
+  CgenClassTable *table = recv_class->get_classtable();
+  for (int t = recv_class->get_tag() + 1; t <= recv_class->get_max_child();
+       t++) {
+    CgenNode *sub = table->get_class_by_tag(t);
+    if (!sub->defines_method(name)) {
+      continue;
+    }
+    std::vector<bool> sub_captures =
+        method_captures(sub, sub->find_method(name, owner));
+    for (size_t i = 0; i < captures.size(); i++) {
+      captures[i] = captures[i] || sub_captures[i];
+    }
+  }
+  return captures;
+}
+
+// self is variable 0 and the formals follow it. The body's value is
+// returned, so it escapes.
+void escape_analysis(method_class *method, EscapeState &state) {
+  Formals formals = method->get_formals();
+  do {
+    state.restart();
+    state.bind(self, state.new_var());
+    for (int i = formals->first(); formals->more(i); i = formals->next(i)) {
+      state.bind(formals->nth(i)->get_name(), state.new_var());
+    }
+    method->get_expr()->escape(&state, true);
+  } while (state.changed);
 }
 #endif
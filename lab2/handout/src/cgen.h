@@ -10,6 +10,28 @@
 
 // ------------------ INSERT DESIGN DOCUMENTATION HERE --------------------- //
 
+// Memory management: objects come from the runtime's collected heap
+// (Object_alloc in coolrt.cc). Each method keeps its object references in
+// the root slots of a shadow stack frame (%_GcFrame) that it pushes on entry
+// and pops before returning; a slot is reserved for every object-typed let
+// as it is generated. Objects are traced through the per-class
+// pointer maps emitted by CgenNode::code_ptrmap and indexed by class tag in
+// @_ptrmap_table. Young objects move, so every reference stored into an
+// attribute goes through code_attr_store, which calls the runtime's write
+// barrier after the store.
+//
+// Each method body is generated in a single walk. Instructions go to a
+// buffer, and storage (allocas and root slots) to another one through
+// CgenEnvironment::new_alloca and new_root. When the walk is done,
+// method_class::code prints the frame setup and the storage into the entry
+// block, followed by the body.
+//
+// Escape analysis (EscapeState, method_captures) finds the `new` expressions
+// whose object is never returned, stored to an attribute or passed to a
+// method that may keep it. Those objects get an alloca in the entry block
+// instead of a heap block. They are still referenced from root slots, and
+// the collector scans their fields from there.
+
 // ----------------------------- END DESIGN DOCS --------------------------- //
 
 #include "cool_tree.h"
@@ -17,6 +39,7 @@
 #include "symtab.h"
 #include "value_printer.h"
 #include <map>
+#include <sstream>
 
 class CgenNode;
 
@@ -54,6 +77,10 @@ private:
 #endif
   void code_constants();
   void code_main();
+#ifdef LAB2
+  void code_ptrmap_table();
+  void code_new_table();
+#endif
 
   /* Util functions */
 #ifndef LAB2
@@ -62,10 +89,12 @@ private:
   CgenNode *root(); // Get the root of the class Tree, i.e. Object
 public:
   int get_num_classes() const { return current_tag; }
+  CgenNode *get_class_by_tag(int tag) { return by_tag[tag]; }
 
 private:
   // Class lists and current class tag
   std::vector<CgenNode *> nds, special_nds;
+  std::vector<CgenNode *> by_tag;
   int current_tag;
 
 public:
@@ -109,53 +138,65 @@ public:
     return "_" + get_type_name() + "_vtable_prototype";
   }
   std::string get_init_function_name() { return get_type_name() + "_new"; }
+  std::string get_ptrmap_name() { return "_" + get_type_name() + "_ptrmap"; }
+  std::string get_name_bytes_name() { return "_" + get_type_name() + "_name"; }
+  std::string get_type_name_string_name() {
+    return "_" + get_type_name() + "_type_name";
+  }
+  int get_ptrmap_size() const { return ptrmap_size; }
 #endif
 
   // TODO: Complete the implementations of following functions
   // and add more as necessary
 
-    //containers
-    //6,7
-    std::vector<operand> formal_operand_list;
-    std::vector<op_type> vtable_op_type_list;
-    std::vector<const_value> vtable_constant_value_list;
-
-    //1
-    std::vector<Symbol> attribute_list;
-    std::vector<Symbol> attribute_type_list;
-    std::vector<std::string> attribute_return_list;
-
-    //2
-    std::vector<op_type> attr__ret_types;
-
-    //8
-    std::vector<op_type> nvtable_op_types;
-    std::vector<const_value> nvtable_const_values;
-    std::vector<std::string> nvtable_reutenr_list;
-
-    //3
-    std::vector<const_value> vt_val;
-    std::vector<op_type> vt_type;
-
-    //additions
+#ifdef LAB2
+  // Types of the fields after the vtable pointer, inherited ones first
+  std::vector<op_type> attr_types;
+  // Method names in vtable slot order, inherited ones first
+  std::vector<Symbol> method_slots;
+#endif
 
   // Class setup. You need to write the body of this function.
   void setup(int tag, int depth);
 #ifdef LAB2
   // Layout the methods and attributes for code generation
   void layout_features();
+  // Emit the object and vtable types
+  void code_types();
+  // Emit the vtable prototype
+  void code_vtable();
+  // The type of the function this class defines for method, and the types
+  // of its self and formals
+  op_func_type get_method_type(method_class *method);
+  std::vector<op_type> get_method_arg_types(method_class *method);
   // Class codegen. You need to write the body of this function.
   void code_class();
   // Codegen for the init function of every class
   void code_init_function(CgenEnvironment *env);
+  // The attributes whose initial value X_new stores
+  std::vector<attr_class *> get_init_attrs();
+  // Fold constants in the method bodies and attribute initializers
+  void fold_features();
+  // Emit the collector's map of object-valued attribute offsets
+  void code_ptrmap();
+  // Emit the class name and the String object type_name() returns for it
+  void code_type_name();
+  // Field index of attribute name in the object layout, and its field type
+  int get_attr_index(Symbol name, op_type &type);
+  // The definition of method name that objects of this class run, and the
+  // class it is defined in
+  method_class *find_method(Symbol name, CgenNode *&owner);
+  bool defines_method(Symbol name);
+  // Whether a proper subclass redefines method name (class hierarchy
+  // analysis over the tag range tag+1..max_child)
+  bool is_overridden_below(Symbol name);
+  // Slot of method name among the methods in the vtable
+  int get_method_index(Symbol name);
 #endif
   void codeGenMainmain();
 
 // TODO: Add more functions / fields here as necessary.
   op_type type_identifier(Symbol type);
-
-    bool is_built_in_class_question_mark(Symbol name);
-    bool is_built_in_class_question_mark(std::string name);
 private:
   CgenNode *parentnd;               // Parent of class
   std::vector<CgenNode *> children; // Children of class
@@ -163,6 +204,7 @@ private:
   CgenClassTable *class_table;
   // Class tag. Should be unique for each class in the tree
   int tag, max_child;
+  int ptrmap_size = 0; // entries in the pointer map, terminator included
   std::ostream *ct_stream;
 
 
@@ -184,7 +226,7 @@ public:
         ok_count(0), then_count(0), else_count(0), fi_count(0),
         if_temp_count(0), obj_count(0), while_temp_var(0), loop_cond_count(0),
         loop_body_count(0), loop_pool_count(0), assign_count(0),
-        cur_stream(&stream) {
+        root_count(0), cur_stream(&stream), alloca_stream(&stream) {
     var_table.enterscope();
     // TODO: add code here
   }
@@ -220,22 +262,25 @@ public:
   std::string new_loop_body_label() { return "body." + std::to_string(loop_body_count++);}
   std::string new_pool_label() { return "pool." + std::to_string(loop_pool_count++);}
 
-
-  //ez lmfao
-  void reset_counters() {block_count = 0;
-                         tmp_count = 0;
-                         ok_count = 0;
-                         then_count = 0;
-                         else_count = 0;
-                         fi_count = 0;
-                         if_temp_count = 0;
-                         obj_count = 0;
-                         while_temp_var = 0;
-                         loop_cond_count = 0;
-                         loop_body_count = 0;
-                         loop_pool_count = 0;
-                         assign_count = 0;
+  // Begin a block of the method and remember it as the one being printed,
+  // which a phi names as the predecessor its operand comes from
+  void begin_block(const std::string &label) {
+    ValuePrinter(*cur_stream).begin_block(label);
+    cur_block = label;
   }
+  const std::string &current_block() const { return cur_block; }
+
+  // Shadow stack root slots. The frame is set up once the body has been
+  // generated and the count is known.
+  int new_root_slot() { return root_count++; }
+  int get_num_roots() const { return root_count; }
+  operand get_roots() { return operand(op_type("Object", 2), "gc.roots"); }
+
+  // Storage for the method, printed to alloca_stream so that it ends up in
+  // the entry block ahead of the body: a stack slot of the given type, or a
+  // fresh root slot seen as a pointer to an object of the given type
+  operand new_alloca(op_type type);
+  operand new_root(op_type type);
 
   CgenNode *get_class() { return cur_class; }
   void set_class(CgenNode *c) { cur_class = c; }
@@ -263,13 +308,83 @@ private:
   CgenNode *cur_class;
   int block_count, tmp_count, ok_count, obj_count, then_count, else_count, fi_count, if_temp_count, while_temp_var, loop_cond_count, loop_body_count, loop_pool_count, assign_count; // Keep counters for unique name
                                         // generation in the current method
+  int root_count;
+  std::string cur_block; // label of the block being printed
 
 public:
   std::ostream *cur_stream;
+  std::ostream *alloca_stream;
   operand bc_return;
 
 };
 
+// EscapeState tracks one method body during escape analysis. Every binding
+// (self, the formals, lets and case branches) is a variable numbered in the
+// order the walk reaches it, which is the same on every walk, so the set of
+// escaping variables can grow over repeated walks until it stops changing.
+class EscapeState {
+public:
+  EscapeState(CgenNode *cls) : cls(cls), loop_depth(0), changed(false) {}
+
+  // Start another walk over the body
+  void restart() {
+    depths.clear();
+    scope.clear();
+    loop_depth = 0;
+    changed = false;
+  }
+  // Number the next variable; it is in scope once bound
+  int new_var() {
+    int var = depths.size();
+    depths.push_back(loop_depth);
+    if (escaping.size() < depths.size()) {
+      escaping.push_back(false);
+      assigned.push_back(false);
+    }
+    return var;
+  }
+  void bind(Symbol name, int var) { scope.push_back({name, var}); }
+  void unbind() { scope.pop_back(); }
+  // The variable name refers to, or -1 for an attribute
+  int lookup(Symbol name) {
+    for (auto b = scope.rbegin(); b != scope.rend(); ++b) {
+      if (b->first == name) {
+        return b->second;
+      }
+    }
+    return -1;
+  }
+  bool var_escapes(int var) { return escaping[var]; }
+  int var_depth(int var) { return depths[var]; }
+  void mark_escaping(int var) {
+    if (!escaping[var]) {
+      escaping[var] = true;
+      changed = true;
+    }
+  }
+  // Whether the variable is the target of an assignment; an Int or Bool one
+  // that never is can be kept in a register instead of a stack slot
+  bool var_assigned(int var) { return assigned[var]; }
+  void mark_assigned(int var) { assigned[var] = true; }
+
+  CgenNode *cls;
+  int loop_depth; // loops around the expression being walked
+  bool changed;   // whether this walk marked a new variable as escaping
+
+private:
+  std::vector<int> depths;
+  std::vector<bool> escaping;
+  std::vector<bool> assigned;
+  std::vector<std::pair<Symbol, int>> scope;
+};
+
+// Function bodies are generated into buffers (see CgenEnvironment). Return
+// from the function with its shadow stack frame popped, and, once the body
+// is done, print its entry block, storage, body and error blocks.
+void code_return(operand val, CgenEnvironment *env);
+void code_entry(std::stringstream &allocas, std::stringstream &body,
+                CgenEnvironment *env);
+
 #ifdef LAB2
 // TODO: implement these functions (LAB2), and add more functions as necessary
 
@@ -277,4 +392,50 @@ public:
 // Generate any code necessary to convert from given operand to
 // dest_type, assuming it has already been checked to be compatible
 operand conform(operand src, op_type dest_type, CgenEnvironment *env);
+
+// The value a variable or attribute of type starts out with
+operand default_value(Symbol type, op_type id_type);
+
+// Load attribute name of self
+operand code_attr_load(Symbol name, CgenEnvironment *env);
+
+// Dispatch: evaluate the receiver and arguments, load a method from a
+// vtable, and call a method directly or through loaded code
+std::vector<operand> code_dispatch_operands(Expression recv, Expressions actual,
+                                            std::vector<op_type> arg_types,
+                                            CgenEnvironment *env);
+operand code_vtblptr(operand recv, CgenEnvironment *env);
+operand code_vtable_load(CgenNode *recv_class, operand vtblptr, Symbol name,
+                         CgenEnvironment *env);
+operand code_method_call(CgenNode *owner, method_class *method,
+                         std::vector<operand> vals, operand fn,
+                         CgenEnvironment *env);
+
+// Dynamic dispatch through an inline cache for the likely receiver classes
+std::vector<CgenNode *> likely_receivers(CgenNode *recv_class, Symbol name);
+operand code_cached_dispatch(CgenNode *recv_class, Symbol name,
+                             std::vector<operand> vals, CgenEnvironment *env);
+
+// Case: the dynamic class tag of an object, the runs of tags that select
+// each branch, and the branch to the one a tag selects
+operand get_class_tag(operand src, CgenNode *src_cls, CgenEnvironment *env);
+std::vector<std::pair<int, int>> case_runs(CgenNode *cls, Cases cases);
+void code_case_select(operand tag, CgenNode *cls,
+                      const std::vector<std::pair<int, int>> &runs,
+                      const std::vector<label> &targets,
+                      const std::string &prefix, CgenEnvironment *env);
+
+// Store val into attribute name of self, with the collector's write barrier
+// when val is an object reference
+void code_attr_store(Symbol name, operand val, CgenEnvironment *env);
+
+// Escape analysis: which of self and the formals (in that order) a method
+// may keep beyond the call, and which of them a dispatch of name to a
+// receiver of class recv_class may keep, over every definition it can run
+std::vector<bool> method_captures(CgenNode *owner, method_class *method);
+std::vector<bool> dispatch_captures(CgenNode *recv_class, Symbol name,
+                                    bool is_static);
+// Walk a method body until its escaping variables are known, which also
+// marks each `new` in it that can live in the method's frame
+void escape_analysis(method_class *method, EscapeState &state);
 #endif
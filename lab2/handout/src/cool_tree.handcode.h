@@ -14,6 +14,7 @@
 
 class CgenEnvironment;
 class CgenNode;
+class EscapeState;
 
 class Program_class;
 typedef Program_class *Program;
@@ -54,13 +55,13 @@ typedef Cases_class *Cases;
 #define Feature_EXTRAS                                                         \
   virtual void dump_with_types(std::ostream &, int) = 0;                       \
   virtual void layout_feature(CgenNode *cls) = 0;                              \
-  virtual void make_alloca(CgenEnvironment *env) = 0;                          \
   virtual void code(CgenEnvironment *env) = 0;
 
 #define Expression_EXTRAS                                                      \
   virtual void dump_with_types(std::ostream &, int) = 0;                       \
-  virtual void make_alloca(CgenEnvironment *) = 0;                             \
   virtual operand code(CgenEnvironment *) = 0;                                 \
+  virtual void escape(EscapeState *, bool) = 0;                                \
+  virtual Expression fold() = 0;                                               \
   Symbol type;                                                                 \
   Symbol get_type() { return type; }                                           \
   Expression set_type(Symbol s) {                                              \
@@ -84,11 +85,14 @@ typedef Cases_class *Cases;
 #define Feature_SHARED_EXTRAS                                                  \
   void dump_with_types(std::ostream &, int);                                   \
   void layout_feature(CgenNode *cls);                                          \
-  virtual void make_alloca(CgenEnvironment *env);                              \
   void code(CgenEnvironment *env);
 
 #define method_EXTRAS                                                          \
-  virtual Symbol get_return_type() { return return_type; }
+  virtual Symbol get_return_type() { return return_type; }                     \
+  Symbol get_name() { return name; }                                           \
+  Formals get_formals() { return formals; }                                    \
+  Expression get_expr() { return expr; }                                       \
+  void fold_body() { expr = expr->fold(); }
 
 #define Formal_EXTRAS                                                          \
   virtual Symbol get_type_decl() = 0; /* ## */                                 \
@@ -102,37 +106,52 @@ typedef Cases_class *Cases;
 
 #define Case_EXTRAS                                                            \
   virtual Symbol get_type_decl() = 0;                                          \
-  virtual void make_alloca(CgenEnvironment *) = 0;                             \
   virtual operand code(operand, operand, const op_type,                        \
                        CgenEnvironment *) = 0;                                 \
+  virtual void escape(EscapeState *, bool) = 0;                                \
+  virtual void fold() = 0;                                                     \
   virtual void dump_with_types(std::ostream &, int) = 0;
 
 #define branch_EXTRAS                                                          \
   Symbol get_type_decl() { return type_decl; }                                 \
   Expression get_expr() { return expr; }                                       \
-  void make_alloca(CgenEnvironment *);                                         \
-  op_type alloca_type;                                                         \
-  operand alloca_op;                                                           \
   operand code(operand expr_val, operand tag, const op_type join_type,         \
                CgenEnvironment *env);                                          \
+  void escape(EscapeState *, bool);                                            \
+  void fold();                                                                 \
   void dump_with_types(std::ostream &, int);
 
 #define Expression_SHARED_EXTRAS                                               \
-  void make_alloca(CgenEnvironment *);                                         \
   operand code(CgenEnvironment *);                                             \
+  void escape(EscapeState *, bool);                                            \
+  Expression fold();                                                           \
   void dump_with_types(std::ostream &, int);
 
 #define no_expr_EXTRAS        /* ## */                                         \
   int no_code() { return 1; } /* ## */
 
+#define object_EXTRAS                                                          \
+  Symbol get_name() { return name; }
+
+#define divide_EXTRAS                                                          \
+  bool nonzero_divisor = false; /* set by fold: no divByZeroError check */
+#define int_const_EXTRAS                                                       \
+  Symbol get_token() { return token; }
+#define bool_const_EXTRAS                                                      \
+  bool get_val() { return val; }
+
 #define cond_EXTRAS                                                            \
   op_type result_type;                                                         \
   operand res_ptr;
+#define attr_EXTRAS                                                            \
+  Symbol get_name() { return name; }                                           \
+  Symbol get_type_decl() { return type_decl; }                                 \
+  void fold_init() { init = init->fold(); }                                    \
+  bool needs_init(); /* whether X_new stores into the field */
+
 #define let_EXTRAS                                                             \
-  op_type id_type;                                                             \
-  operand id_op;
-#define typcase_EXTRAS                                                         \
-  op_type alloca_type;                                                         \
-  operand alloca_op;
+  bool reassigned = true; /* set by escape analysis */
+#define new__EXTRAS                                                            \
+  bool on_stack = false; /* set by escape analysis */
 
 #endif /* COOL_TREE_HANDCODE_H */
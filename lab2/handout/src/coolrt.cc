@@ -1,8 +1,18 @@
 #include "coolrt.h"
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* This file provides the runtime library for cool. It implements
    the functions of the cool classes in C
@@ -17,12 +27,18 @@ const char IO_string[] = "IO";
 
 const char default_string[] = "";
 
-/* Class vtable prototypes */
+/*
+ * Class vtable prototypes. cgen emits these along with those of the user
+ * classes (CgenNode::code_vtable), so they are only kept here to show what
+ * the runtime expects of them.
+ */
 /*
 const Object_vtable _Object_vtable_prototype = {
         .tag = 0,
         .size = sizeof(struct Object),
+        .size_class = (sizeof(struct Object) + 15) >> 3,
         .name = Object_string,
+        .name_string = &_Object_type_name,
 
         .abort_object     = Object_abort,
         .type_name_object = Object_type_name,
@@ -32,7 +48,9 @@ const Object_vtable _Object_vtable_prototype = {
 const Int_vtable _Int_vtable_prototype = {
         .tag = 1,
         .size = sizeof(struct Int),
+        .size_class = (sizeof(struct Int) + 15) >> 3,
         .name = Int_string,
+        .name_string = &_Int_type_name,
 
         .abort_int     = Object_abort,
         .type_name_int = Object_type_name,
@@ -42,7 +60,9 @@ const Int_vtable _Int_vtable_prototype = {
 const Bool_vtable _Bool_vtable_prototype = {
         .tag = 2,
         .size = sizeof(struct Bool),
+        .size_class = (sizeof(struct Bool) + 15) >> 3,
         .name = Bool_string,
+        .name_string = &_Bool_type_name,
 
         .abort_bool     = Object_abort,
         .type_name_bool = Object_type_name,
@@ -52,7 +72,9 @@ const Bool_vtable _Bool_vtable_prototype = {
 const String_vtable _String_vtable_prototype = {
         .tag = 3,
         .size = sizeof(struct String),
+        .size_class = (sizeof(struct String) + 15) >> 3,
         .name = String_string,
+        .name_string = &_String_type_name,
 
         .abort_string     = Object_abort,
         .type_name_string = Object_type_name,
@@ -65,7 +87,9 @@ const String_vtable _String_vtable_prototype = {
 const IO_vtable _IO_vtable_prototype = {
         .tag = 4,
         .size = sizeof(struct IO),
+        .size_class = (sizeof(struct IO) + 15) >> 3,
         .name = IO_string,
+        .name_string = &_IO_type_name,
 
         .abort_io      = Object_abort,
         .type_name_io  = Object_type_name,
@@ -79,21 +103,733 @@ const IO_vtable _IO_vtable_prototype = {
 */
 
 /*
-// Methods in class object (only some are provided to you)
+// Object allocation
 */
-Object *Object_new() {
-  Object *o = (Object *)malloc(sizeof(Object));
-  if (o == 0) {
+
+/*
+ * Objects are carved out of thread-local chunks by bumping a pointer, so
+ * constructors never reach malloc() on the fast path. An object larger than
+ * COOL_LARGE_OBJECT gets a chunk of its own. A thread's chunks are released
+ * when it exits, and the exiting thread's from atexit().
+ *
+ * Every block starts with a Block header holding its size and GC flags, so a
+ * chunk can be walked from front to back. Chunks are COOL_CHUNK_SIZE aligned,
+ * which lets the collector tell heap pointers from pointers to static data.
+ *
+ * When the collector is on, small objects are first bumped out of a nursery
+ * (COOL_NURSERY_SIZE bytes, overridable from the environment) and the chunks
+ * above only hold objects that survived a minor collection, plus large ones.
+ *
+ * Running with COOL_DEBUG_MALLOC=1 in the environment gives every object its
+ * own malloc() instead, so that gc.so can report leaks object by object. The
+ * collector is off in that mode.
+ */
+#define COOL_CHUNK_SIZE (64 * 1024)
+#define COOL_LARGE_OBJECT (COOL_CHUNK_SIZE / 4)
+#define COOL_ALIGN 8
+#define COOL_GC_MIN_THRESHOLD (4 * 1024 * 1024)
+#define COOL_NURSERY_SIZE (256 * 1024)
+#define COOL_SIZE_CLASSES 64 /* free lists for blocks below 512 bytes */
+
+#define BLOCK_MARK 1
+#define BLOCK_FREE 2
+#define BLOCK_FORWARDED 4  /* nursery block copied out, payload holds new address */
+#define BLOCK_REMEMBERED 8 /* old object on the remembered set */
+
+typedef struct Chunk Chunk;
+struct Chunk {
+  Chunk *next;
+  size_t size; /* payload bytes following this header */
+  int large;   /* payload is a single large block */
+  int pad;     /* keeps the payload COOL_ALIGN aligned */
+};
+
+typedef struct Block Block;
+struct Block {
+  unsigned size; /* whole block, header included */
+  unsigned flags;
+};
+
+/* A run of free blocks, linked into the list the allocator bumps through */
+typedef struct Span Span;
+struct Span {
+  Block hdr;
+  Span *next;
+};
+
+static __thread char *alloc_ptr = 0;
+static __thread char *alloc_limit = 0;
+static __thread Chunk *chunk_list = 0;
+static __thread Span *free_spans = 0;
+static __thread Block *free_lists[COOL_SIZE_CLASSES];
+static __thread size_t bytes_since_gc = 0;
+static __thread size_t gc_threshold = COOL_GC_MIN_THRESHOLD;
+static __thread bool in_gc = false;
+static bool debug_malloc = false;
+
+static __thread char *nursery_start = 0;
+static __thread char *nursery_ptr = 0;
+static __thread char *nursery_end = 0;
+static size_t nursery_size = COOL_NURSERY_SIZE;
+
+/* Open-addressing set of chunk base addresses */
+#define CHUNK_TOMBSTONE ((Chunk *)1)
+static __thread Chunk **chunk_set = 0;
+static __thread size_t chunk_set_cap = 0, chunk_set_used = 0;
+
+static size_t chunk_hash(Chunk *c) {
+  return ((uintptr_t)c / COOL_CHUNK_SIZE) * 0x9E3779B97F4A7C15ull;
+}
+
+static void chunk_set_insert(Chunk *c);
+
+static void chunk_set_grow(void) {
+  Chunk **old = chunk_set;
+  size_t old_cap = chunk_set_cap;
+  chunk_set_cap = old_cap ? old_cap * 2 : 64;
+  chunk_set = (Chunk **)calloc(chunk_set_cap, sizeof(Chunk *));
+  if (chunk_set == 0) {
     fprintf(stderr, "At %s(line %d): Out of memory\n", __FILE__, __LINE__);
     Object_abort((Object *)0);
   }
-  o->vtblptr = &_Object_vtable_prototype;
+  chunk_set_used = 0;
+  for (size_t i = 0; i < old_cap; i++)
+    if (old[i] && old[i] != CHUNK_TOMBSTONE)
+      chunk_set_insert(old[i]);
+  free(old);
+}
+
+static void chunk_set_insert(Chunk *c) {
+  if ((chunk_set_used + 1) * 2 > chunk_set_cap)
+    chunk_set_grow();
+  size_t mask = chunk_set_cap - 1, i = chunk_hash(c) & mask;
+  while (chunk_set[i] && chunk_set[i] != CHUNK_TOMBSTONE)
+    i = (i + 1) & mask;
+  if (!chunk_set[i])
+    chunk_set_used++;
+  chunk_set[i] = c;
+}
+
+static Chunk **chunk_set_find(Chunk *c) {
+  if (chunk_set_cap == 0)
+    return 0;
+  size_t mask = chunk_set_cap - 1, i = chunk_hash(c) & mask;
+  while (chunk_set[i]) {
+    if (chunk_set[i] == c)
+      return &chunk_set[i];
+    i = (i + 1) & mask;
+  }
+  return 0;
+}
+
+/* Does p point into a chunk of this thread's heap? */
+static bool is_heap(const void *p) {
+  return chunk_set_find((Chunk *)((uintptr_t)p & ~(uintptr_t)(COOL_CHUNK_SIZE - 1)));
+}
+
+/* Any non-null value makes pthreads run release_heap() when the thread exits */
+static pthread_key_t heap_key;
+
+static void own_heap(void) {
+  pthread_setspecific(heap_key, (void *)1);
+}
+
+static Chunk *new_chunk(size_t size, int large) {
+  size_t total = (sizeof(Chunk) + size + COOL_CHUNK_SIZE - 1) &
+                 ~(size_t)(COOL_CHUNK_SIZE - 1);
+  Chunk *c = (Chunk *)aligned_alloc(COOL_CHUNK_SIZE, total);
+  if (c == 0) {
+    fprintf(stderr, "At %s(line %d): Out of memory\n", __FILE__, __LINE__);
+    Object_abort((Object *)0);
+  }
+  if (chunk_list == 0)
+    own_heap();
+  c->next = chunk_list;
+  c->size = total - sizeof(Chunk);
+  c->large = large;
+  chunk_list = c;
+  chunk_set_insert(c);
+  return c;
+}
+
+static void release_chunk(Chunk *c) {
+  *chunk_set_find(c) = CHUNK_TOMBSTONE;
+  free(c);
+}
+
+static void release_gc_stacks(void);
+
+static void release_chunks(void) {
+  release_gc_stacks();
+  while (chunk_list) {
+    Chunk *next = chunk_list->next;
+    free(chunk_list);
+    chunk_list = next;
+  }
+  free(chunk_set);
+  chunk_set = 0;
+  chunk_set_cap = chunk_set_used = 0;
+  alloc_ptr = alloc_limit = 0;
+  free_spans = 0;
+  memset(free_lists, 0, sizeof(free_lists));
+  free(nursery_start);
+  nursery_start = nursery_ptr = nursery_end = 0;
+}
+
+static void release_heap(void *) {
+  release_chunks();
+}
+
+static void init_alloc(void) __attribute__((constructor));
+static void init_alloc(void) {
+  const char *s = getenv("COOL_DEBUG_MALLOC");
+  debug_malloc = s && strcmp(s, "1") == 0;
+  s = getenv("COOL_NURSERY_SIZE");
+  if (s && atol(s) > 0) {
+    nursery_size = ((size_t)atol(s) + COOL_ALIGN - 1) & ~(size_t)(COOL_ALIGN - 1);
+    if (nursery_size < COOL_CHUNK_SIZE)
+      nursery_size = COOL_CHUNK_SIZE;
+  }
+  pthread_key_create(&heap_key, release_heap);
+  atexit(release_chunks);
+}
+
+/* Turn the unused rest of the current bump region into a free block */
+static void retire_region(void) {
+  if (alloc_ptr < alloc_limit) {
+    Block *b = (Block *)alloc_ptr;
+    b->size = alloc_limit - alloc_ptr;
+    b->flags = BLOCK_FREE;
+    bytes_since_gc -= b->size;
+  }
+  alloc_ptr = alloc_limit = 0;
+}
+
+static bool gc_enabled(void) { return _ptrmap_table != 0 && !debug_malloc; }
+
+/* Find a new bump region with room for n bytes */
+static void refill(size_t n) {
+  retire_region();
+  if (bytes_since_gc >= gc_threshold && gc_enabled() && !in_gc)
+    cool_gc_collect();
+
+  while (free_spans) {
+    Span *span = free_spans;
+    free_spans = span->next;
+    if (span->hdr.size >= n) {
+      alloc_ptr = (char *)span;
+      alloc_limit = alloc_ptr + span->hdr.size;
+      bytes_since_gc += span->hdr.size;
+      return;
+    }
+    /* too small: it stays behind as a free block until the next sweep */
+  }
+
+  Chunk *c = new_chunk(COOL_CHUNK_SIZE - sizeof(Chunk), 0);
+  alloc_ptr = (char *)(c + 1);
+  alloc_limit = alloc_ptr + c->size;
+  bytes_since_gc += c->size;
+}
+
+/* Allocate an n byte block, header included, outside the nursery */
+static Block *old_alloc(size_t n) {
+  Block *b;
+  if (n > COOL_LARGE_OBJECT) {
+    if (bytes_since_gc >= gc_threshold && gc_enabled() && !in_gc)
+      cool_gc_collect();
+    Chunk *c = new_chunk(n, 1);
+    bytes_since_gc += n;
+    b = (Block *)(c + 1);
+  } else if (n / COOL_ALIGN < COOL_SIZE_CLASSES && free_lists[n / COOL_ALIGN]) {
+    b = free_lists[n / COOL_ALIGN];
+    free_lists[n / COOL_ALIGN] = *(Block **)(b + 1);
+    bytes_since_gc += n;
+  } else {
+    if ((size_t)(alloc_limit - alloc_ptr) < n)
+      refill(n);
+    b = (Block *)alloc_ptr;
+    alloc_ptr += n;
+  }
+  b->size = n;
+  b->flags = 0;
+  return b;
+}
+
+static bool in_nursery(const void *p) {
+  return (const char *)p >= nursery_start && (const char *)p < nursery_end;
+}
+
+static void minor_collect(void);
+static void major_collect(void);
+
+/* Make the whole nursery available again, collecting it if it was in use */
+static void nursery_refill(void) {
+  if (nursery_start == 0) {
+    own_heap();
+    nursery_start = (char *)malloc(nursery_size);
+    if (nursery_start == 0) {
+      fprintf(stderr, "At %s(line %d): Out of memory\n", __FILE__, __LINE__);
+      Object_abort((Object *)0);
+    }
+    nursery_end = nursery_start + nursery_size;
+  } else {
+    minor_collect();
+    if (bytes_since_gc >= gc_threshold)
+      major_collect();
+  }
+  nursery_ptr = nursery_start;
+}
+
+/* Allocate an n byte block, header included, and return its zeroed payload */
+static void *alloc_block(size_t n) {
+  if (debug_malloc) {
+    void *p = malloc(n - sizeof(Block));
+    if (p == 0) {
+      fprintf(stderr, "At %s(line %d): Out of memory\n", __FILE__, __LINE__);
+      Object_abort((Object *)0);
+    }
+    return memset(p, 0, n - sizeof(Block));
+  }
+
+  Block *b;
+  if (n <= COOL_LARGE_OBJECT && gc_enabled()) {
+    if ((size_t)(nursery_end - nursery_ptr) < n)
+      nursery_refill();
+    b = (Block *)nursery_ptr;
+    nursery_ptr += n;
+    b->size = n;
+    b->flags = 0;
+  } else {
+    b = old_alloc(n);
+  }
+  return memset(b + 1, 0, n - sizeof(Block));
+}
+
+/* Allocate size bytes of zeroed object storage. */
+void *cool_alloc(int size) {
+  assert(size > 0);
+  size_t n = ((size_t)size + COOL_ALIGN - 1) & ~(size_t)(COOL_ALIGN - 1);
+  return alloc_block(n + sizeof(Block));
+}
+
+/* Block size of an object of the class described by vtbl */
+static size_t object_block_size(const Object_vtable *vtbl) {
+  if (vtbl->size_class)
+    return (size_t)vtbl->size_class * COOL_ALIGN;
+  assert(vtbl->size > 0);
+  return (((size_t)vtbl->size + COOL_ALIGN - 1) & ~(size_t)(COOL_ALIGN - 1)) +
+         sizeof(Block);
+}
+
+/*
+ * Allocate an object of the class described by vtbl. All vtables start with
+ * the same tag/size/size_class/name header, so the generated X_new functions
+ * pass their own prototype here.
+ */
+Object *Object_alloc(const Object_vtable *vtbl) {
+  Object *o = (Object *)alloc_block(object_block_size(vtbl));
+  o->vtblptr = vtbl;
   return o;
 }
 
+/*
+// Garbage collection
+*/
+
+/*
+ * A precise generational collector. Roots are the slots of the GcFrames that
+ * generated methods (and runtime functions that allocate while holding
+ * objects) push on a shadow stack. Objects are traced through the per-class
+ * pointer maps cgen emits into _ptrmap_table, indexed by vtable tag; String
+ * is the one basic class with heap pointers, its byte buffer and the two
+ * halves of a lazy concatenation.
+ *
+ * A minor collection copies the nursery blocks reachable from the roots and
+ * from the remembered set into the old space and updates every reference to
+ * them, so its cost follows the surviving data rather than the allocation
+ * volume. Old objects get on the remembered set through the write barrier,
+ * which must guard every store of a reference into an object.
+ *
+ * The old space is collected by a non-moving mark-sweep that runs when the
+ * bytes promoted since the last one pass gc_threshold. Sweeping coalesces
+ * long runs of dead blocks into spans that the allocator bumps through
+ * again, puts the blocks of short runs on the free lists of their sizes, and
+ * gives completely empty chunks back to malloc.
+ */
+static __thread GcFrame *gc_top = 0;
+static __thread Object **mark_stack = 0;
+static __thread size_t mark_top = 0, mark_cap = 0;
+static __thread Object **remembered = 0;
+static __thread size_t remembered_top = 0, remembered_cap = 0;
+
+void cool_gc_push_frame(GcFrame *frame, Object **roots, int num_roots) {
+  memset(roots, 0, num_roots * sizeof(Object *));
+  frame->prev = gc_top;
+  frame->num_roots = num_roots;
+  frame->roots = roots;
+  gc_top = frame;
+}
+
+void cool_gc_pop_frame(GcFrame *frame) {
+  assert(gc_top == frame);
+  gc_top = frame->prev;
+}
+
+/* Give back the mark stack and remembered set along with the heap */
+static void release_gc_stacks(void) {
+  free(mark_stack);
+  mark_stack = 0;
+  mark_top = mark_cap = 0;
+  free(remembered);
+  remembered = 0;
+  remembered_top = remembered_cap = 0;
+}
+
+static void push_object(Object ***stack, size_t *top, size_t *cap, Object *o) {
+  if (*top == *cap) {
+    *cap = *cap ? *cap * 2 : 1024;
+    *stack = (Object **)realloc(*stack, *cap * sizeof(Object *));
+    if (*stack == 0) {
+      fprintf(stderr, "At %s(line %d): Out of memory\n", __FILE__, __LINE__);
+      abort();
+    }
+  }
+  (*stack)[(*top)++] = o;
+}
+
+/* Put an old object on the remembered set */
+static void remember(Object *obj) {
+  Block *b = (Block *)obj - 1;
+  if (in_nursery(obj) || !is_heap(obj) || (b->flags & BLOCK_REMEMBERED))
+    return;
+  b->flags |= BLOCK_REMEMBERED;
+  push_object(&remembered, &remembered_top, &remembered_cap, obj);
+}
+
+/* Record that obj now holds a reference to val */
+void cool_gc_write_barrier(Object *obj, const void *val) {
+  if (in_nursery(val))
+    remember(obj);
+}
+
+/* Copy a nursery block to the old space, or find where it was copied to */
+static void *promote(const void *p, bool is_object) {
+  if (!in_nursery(p))
+    return (void *)p;
+  Block *b = (Block *)p - 1;
+  if (b->flags & BLOCK_FORWARDED)
+    return *(void **)(b + 1);
+  Block *nb = old_alloc(b->size);
+  memcpy(nb + 1, b + 1, b->size - sizeof(Block));
+  b->flags |= BLOCK_FORWARDED;
+  *(void **)(b + 1) = nb + 1;
+  if (is_object)
+    push_object(&mark_stack, &mark_top, &mark_cap, (Object *)(nb + 1));
+  return nb + 1;
+}
+
+/* Promote everything an old object refers to in the nursery */
+static void promote_fields(Object *o) {
+  const Object_vtable *vt = o->vtblptr;
+  if (vt == (const Object_vtable *)&_String_vtable_prototype) {
+    String *s = (String *)o;
+    s->val = (const char *)promote(s->val, false);
+    s->left = (String *)promote(s->left, true);
+    s->right = (String *)promote(s->right, true);
+    return;
+  }
+  const int *map = _ptrmap_table[vt->tag];
+  if (map == 0)
+    return;
+  for (; *map >= 0; map++) {
+    Object **slot = (Object **)((char *)o + *map);
+    *slot = (Object *)promote(*slot, true);
+  }
+}
+
+/*
+ * Is o an object that a generated method keeps in its own frame? Escape
+ * analysis only puts objects of classes cgen lays out there, and never stores
+ * a reference to one into another object, so they are only found in roots.
+ * Unlike the constant Strings, they may refer to heap objects.
+ */
+static bool in_frame(const Object *o) {
+  return o != 0 && !in_nursery(o) && !is_heap(o) &&
+         _ptrmap_table[o->vtblptr->tag] != 0;
+}
+
+static void minor_collect(void) {
+  in_gc = true;
+  for (GcFrame *f = gc_top; f; f = f->prev)
+    for (int i = 0; i < f->num_roots; i++) {
+      if (in_frame(f->roots[i]))
+        promote_fields(f->roots[i]);
+      f->roots[i] = (Object *)promote(f->roots[i], true);
+    }
+
+  while (remembered_top > 0) {
+    Object *o = remembered[--remembered_top];
+    ((Block *)o - 1)->flags &= ~BLOCK_REMEMBERED;
+    promote_fields(o);
+  }
+  while (mark_top > 0)
+    promote_fields(mark_stack[--mark_top]);
+
+  nursery_ptr = nursery_start;
+  in_gc = false;
+}
+
+static void mark_object(Object *o) {
+  if (o == 0 || !is_heap(o))
+    return;
+  Block *b = (Block *)o - 1;
+  if (b->flags & BLOCK_MARK)
+    return;
+  b->flags |= BLOCK_MARK;
+  push_object(&mark_stack, &mark_top, &mark_cap, o);
+}
+
+/* Mark a block that holds bytes rather than an object */
+static void mark_raw(const void *p) {
+  if (p != 0 && is_heap(p))
+    ((Block *)p - 1)->flags |= BLOCK_MARK;
+}
+
+static void scan_object(Object *o) {
+  const Object_vtable *vt = o->vtblptr;
+  if (vt == (const Object_vtable *)&_String_vtable_prototype) {
+    String *s = (String *)o;
+    mark_raw(s->val);
+    mark_object((Object *)s->left);
+    mark_object((Object *)s->right);
+    return;
+  }
+  const int *map = _ptrmap_table[vt->tag];
+  if (map == 0)
+    return;
+  for (; *map >= 0; map++)
+    mark_object(*(Object **)((char *)o + *map));
+}
+
+/*
+ * Format [start, end) as one free block. A block that fits a size class goes
+ * on that class's free list, where only an allocation of exactly its size
+ * will take it; anything bigger is queued as a span to bump through.
+ */
+static void make_span(char *start, char *end, Span ***tail) {
+  Span *span = (Span *)start;
+  size_t size = end - start;
+  span->hdr.size = size;
+  span->hdr.flags = BLOCK_FREE;
+  if (size / COOL_ALIGN < COOL_SIZE_CLASSES) {
+    if (size >= sizeof(Block) + sizeof(Block *)) {
+      *(Block **)(&span->hdr + 1) = free_lists[size / COOL_ALIGN];
+      free_lists[size / COOL_ALIGN] = &span->hdr;
+    }
+  } else {
+    span->next = 0;
+    **tail = span;
+    *tail = &span->next;
+  }
+}
+
+/*
+ * Free the dead blocks in [start, end). A run long enough to bump through is
+ * queued as one span. The blocks of a shorter run each go on the free list of
+ * their own size, which is a size objects are allocated in, rather than as
+ * one block of their combined size that few allocations would ask for.
+ */
+static void free_run(char *start, char *end, Span ***tail) {
+  if ((size_t)(end - start) / COOL_ALIGN >= COOL_SIZE_CLASSES) {
+    make_span(start, end, tail);
+    return;
+  }
+  while (start < end) {
+    char *next = start + ((Block *)start)->size;
+    make_span(start, next, tail);
+    start = next;
+  }
+}
+
+static void sweep(void) {
+  size_t live = 0, kept = 0;
+  Span **tail = &free_spans;
+  Chunk **link = &chunk_list, *c, *empty = 0;
+  free_spans = 0;
+  memset(free_lists, 0, sizeof(free_lists));
+
+  while ((c = *link) != 0) {
+    char *p = (char *)(c + 1), *end = p + c->size;
+    size_t chunk_live = 0;
+
+    if (c->large) {
+      Block *b = (Block *)p;
+      chunk_live = (b->flags & BLOCK_MARK) ? b->size : 0;
+      b->flags &= ~BLOCK_MARK;
+    } else {
+      Span *chunk_spans = 0, **chunk_tail = &chunk_spans;
+      char *span = 0;
+      while (p < end) {
+        Block *b = (Block *)p;
+        if (b->flags & BLOCK_MARK) {
+          if (span) {
+            free_run(span, p, &chunk_tail);
+            span = 0;
+          }
+          b->flags &= ~BLOCK_MARK;
+          chunk_live += b->size;
+        } else if (!span) {
+          span = p;
+        }
+        p += b->size;
+      }
+      if (span && chunk_live)
+        free_run(span, end, &chunk_tail);
+      *tail = chunk_spans;
+      if (chunk_spans)
+        tail = chunk_tail;
+    }
+
+    if (chunk_live) {
+      live += chunk_live;
+      kept += c->size;
+      link = &c->next;
+    } else {
+      *link = c->next;
+      if (c->large) {
+        release_chunk(c);
+      } else {
+        c->next = empty;
+        empty = c;
+      }
+    }
+  }
+
+  bytes_since_gc = 0;
+  gc_threshold = live > COOL_GC_MIN_THRESHOLD ? live : COOL_GC_MIN_THRESHOLD;
+
+  /* Keep enough empty chunks to serve the next cycle, free the rest */
+  while ((c = empty) != 0) {
+    empty = c->next;
+    if (kept < live + gc_threshold) {
+      char *p = (char *)(c + 1);
+      make_span(p, p + c->size, &tail);
+      kept += c->size;
+      c->next = chunk_list;
+      chunk_list = c;
+    } else {
+      release_chunk(c);
+    }
+  }
+}
+
+/* Mark-sweep the old space; the nursery must be empty */
+static void major_collect(void) {
+  retire_region();
+
+  for (GcFrame *f = gc_top; f; f = f->prev)
+    for (int i = 0; i < f->num_roots; i++) {
+      if (in_frame(f->roots[i]))
+        scan_object(f->roots[i]);
+      mark_object(f->roots[i]);
+    }
+  while (mark_top > 0)
+    scan_object(mark_stack[--mark_top]);
+
+  sweep();
+}
+
+void cool_gc_collect(void) {
+  if (!gc_enabled() || in_gc)
+    return;
+  if (nursery_start)
+    minor_collect();
+  major_collect();
+}
+
+/*
+// Output buffering
+*/
+
+/*
+ * IO output goes to one buffer that is written to stdout with write(2) when
+ * it fills up, at exit, and from a SIGABRT handler so that the output of a
+ * program stopped by a runtime error is not lost. Nothing in the runtime
+ * writes to stdout through stdio. On a terminal the buffer is also flushed
+ * before reading input, so prompts show up.
+ */
+#define COOL_OUT_BUFSIZE (64 * 1024)
+
+static char out_buf[COOL_OUT_BUFSIZE];
+static size_t out_len = 0;
+static bool out_interactive = false; /* stdout is a terminal */
+
+static void write_all(const char *p, size_t n) {
+  while (n > 0) {
+    ssize_t w = write(STDOUT_FILENO, p, n);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    p += w;
+    n -= w;
+  }
+}
+
+static void out_flush(void) {
+  write_all(out_buf, out_len);
+  out_len = 0;
+}
+
+static void out_write(const char *s, size_t n) {
+  if (n > COOL_OUT_BUFSIZE - out_len) {
+    out_flush();
+    if (n >= COOL_OUT_BUFSIZE) {
+      write_all(s, n);
+      return;
+    }
+  }
+  memcpy(out_buf + out_len, s, n);
+  out_len += n;
+}
+
+static void out_int(int x) {
+  char buf[16];
+  char *p = buf + sizeof(buf);
+  unsigned u = x < 0 ? 0u - (unsigned)x : (unsigned)x;
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (x < 0)
+    *--p = '-';
+  out_write(p, buf + sizeof(buf) - p);
+}
+
+static void flush_on_abort(int sig) {
+  out_flush();
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+static void init_output(void) __attribute__((constructor));
+static void init_output(void) {
+  out_interactive = isatty(STDOUT_FILENO);
+  atexit(out_flush);
+  signal(SIGABRT, flush_on_abort);
+}
+
+/*
+// Methods in class object (only some are provided to you)
+*/
+Object *Object_new() { return Object_alloc(&_Object_vtable_prototype); }
+
 Object *Object_abort(Object *self) {
-  printf("Abort called from class %s\n",
-         !self ? "Unknown" : self->vtblptr->name);
+  const char *name = !self ? "Unknown" : self->vtblptr->name;
+  out_write("Abort called from class ", 24);
+  out_write(name, strlen(name));
+  out_write("\n", 1);
   exit(1);
   return self;
 }
@@ -103,8 +839,14 @@ String *Object_type_name(Object *self) {
     fprintf(stderr, "At %s(line %d): self is NULL\n", __FILE__, __LINE__);
     abort();
   }
+  /* vtables emitted by cgen point at a constant String for the name */
+  if (self->vtblptr->name_string)
+    return (String *)self->vtblptr->name_string;
+
+  const char *name = self->vtblptr->name;
   String *s = String_new();
-  s->val = self->vtblptr->name;
+  s->val = name;
+  s->len = strlen(name);
   return s;
 }
 
@@ -116,13 +858,17 @@ Object *Object_copy(Object *self) {
 
   unsigned size = self->vtblptr->size;
   assert(size > 0);
-  Object *obj = (Object *)malloc(size);
-  if (obj == 0) {
-    fprintf(stderr, "At %s(line %d): malloc failed in Object::copy()\n",
-            __FILE__, __LINE__);
-    abort();
-  }
-  memcpy(obj, self, size);
+
+  /* self must stay rooted while the copy is allocated */
+  GcFrame frame;
+  Object *roots[1];
+  cool_gc_push_frame(&frame, roots, 1);
+  roots[0] = self;
+  Object *obj = (Object *)alloc_block(object_block_size(self->vtblptr));
+  memcpy(obj, roots[0], size);
+  if (gc_enabled())
+    remember(obj); /* a large copy may hold nursery references */
+  cool_gc_pop_frame(&frame);
   return obj;
 }
 
@@ -130,13 +876,7 @@ Object *Object_copy(Object *self) {
 // Methods in class IO (only some are provided to you)
 */
 IO *IO_new() {
-  IO *io = (IO *)malloc(sizeof(IO));
-  if (io == 0) {
-    fprintf(stderr, "At %s(line %d): Out of memory\n", __FILE__, __LINE__);
-    Object_abort((Object *)0);
-  }
-  io->vtblptr = &_IO_vtable_prototype;
-  return io;
+  return (IO *)Object_alloc((const Object_vtable *)&_IO_vtable_prototype);
 }
 
 IO *IO_out_string(IO *self, String *s) {
@@ -144,7 +884,7 @@ IO *IO_out_string(IO *self, String *s) {
     fprintf(stderr, "At %s(line %d): NULL object\n", __FILE__, __LINE__);
     abort();
   }
-  printf("%s", s->val);
+  out_write(String_val(s), s->len);
   return self;
 }
 
@@ -153,32 +893,137 @@ IO *IO_out_int(IO *self, int x) {
     fprintf(stderr, "At %s(line %d): NULL object\n", __FILE__, __LINE__);
     abort();
   }
-  printf("%d", x);
+  out_int(x);
   return self;
 }
 
 /*
- * Get one line from stream using get_line(), then discard newline character.
- * Allocate string *in_string_p and store result there.
- * Return number of chars read.
+ * Input is read from stdin a block at a time into one buffer, or the whole
+ * file is mapped when stdin is a regular file, and lines are handed out as
+ * pointers into it. A line stays valid until the next one is read. The
+ * buffer or mapping is released at exit.
  */
-static int get_one_line(char **in_string_p, FILE *stream) {
-  /* Get one line worth of input */
-  size_t len = 0;
-  ssize_t num_chars_read;
-  num_chars_read = getline(in_string_p, &len, stdin);
-  if (*in_string_p == 0) {
+#define COOL_IN_BUFSIZE (64 * 1024)
+
+static char *in_buf = 0;
+static size_t in_pos = 0, in_end = 0, in_cap = 0;
+static bool in_eof = false;
+
+/* in_cap is only set for a read buffer; a mapping is in_end bytes long */
+static void release_input(void) {
+  if (in_cap)
+    free(in_buf);
+  else
+    munmap(in_buf, in_end);
+  in_buf = 0;
+  in_pos = in_end = in_cap = 0;
+}
+
+/* Map stdin if it is a regular file with input left; otherwise fall back to
+   read(2) */
+static void init_input(void) {
+  struct stat st;
+  atexit(release_input);
+  /* Start where stdin is positioned, since whoever opened it may have
+     consumed some of it already; the mapping starts at the page before */
+  off_t pos = lseek(STDIN_FILENO, 0, SEEK_CUR);
+  if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) && pos >= 0 &&
+      pos < st.st_size) {
+    off_t base = pos & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+    void *p = mmap(0, st.st_size - base, PROT_READ, MAP_PRIVATE, STDIN_FILENO,
+                   base);
+    if (p != MAP_FAILED) {
+      madvise(p, st.st_size - base, MADV_SEQUENTIAL);
+      in_buf = (char *)p;
+      in_pos = pos - base;
+      in_end = st.st_size - base;
+      in_eof = true;
+      return;
+    }
+  }
+  in_cap = COOL_IN_BUFSIZE;
+  in_buf = (char *)malloc(in_cap);
+  if (in_buf == 0) {
     fprintf(stderr, "At %s(line %d): allocation failed in IO::in_string()\n",
             __FILE__, __LINE__);
     exit(1);
   }
+}
+
+/* Read another block, keeping the unconsumed bytes; false at end of input */
+static bool fill_input(void) {
+  if (in_eof)
+    return false;
+  if (in_pos > 0) {
+    memmove(in_buf, in_buf + in_pos, in_end - in_pos);
+    in_end -= in_pos;
+    in_pos = 0;
+  }
+  if (in_end == in_cap) {
+    in_cap *= 2;
+    in_buf = (char *)realloc(in_buf, in_cap);
+    if (in_buf == 0) {
+      fprintf(stderr, "At %s(line %d): allocation failed in IO::in_string()\n",
+              __FILE__, __LINE__);
+      exit(1);
+    }
+  }
+  for (;;) {
+    ssize_t n = read(STDIN_FILENO, in_buf + in_end, in_cap - in_end);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      in_eof = true;
+      return false;
+    }
+    in_end += n;
+    return true;
+  }
+}
+
+/* First newline in [p, end), or end */
+static const char *find_newline(const char *p, const char *end) {
+#ifdef __SSE2__
+  const __m128i nl = _mm_set1_epi8('\n');
+  for (; end - p >= 16; p += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+#endif
+  const char *q = (const char *)memchr(p, '\n', end - p);
+  return q ? q : end;
+}
+
+/*
+ * Get one line from stdin and discard its newline character, if any.
+ * *line_p is set to the first byte, which is not NUL terminated.
+ * Return number of chars in the line.
+ */
+static size_t get_one_line(const char **line_p) {
+  if (out_interactive)
+    out_flush();
+  if (in_buf == 0)
+    init_input();
 
-  /* Discard the newline char, if any.  It may not exist if EOF reached. */
-  if (num_chars_read > 0 && (*in_string_p)[num_chars_read - 1] == '\n') {
-    (*in_string_p)[num_chars_read - 1] = '\0';
-    --len;
+  size_t scanned = in_pos;
+  const char *nl;
+  for (;;) {
+    nl = find_newline(in_buf + scanned, in_buf + in_end);
+    if (nl < in_buf + in_end)
+      break;
+    /* the line may continue past the buffer: only rescan the new bytes */
+    scanned = in_end - in_pos;
+    if (!fill_input()) {
+      nl = in_buf + in_end;
+      break;
+    }
   }
 
+  *line_p = in_buf + in_pos;
+  size_t len = nl - (in_buf + in_pos);
+  in_pos += len + (nl < in_buf + in_end);
   return len;
 }
 
@@ -192,14 +1037,25 @@ String *IO_in_string(IO *self) {
     abort();
   }
 
-  /* Get one line worth of input with the newline, if any, discarded */
-  char *in_string = 0;
-  ssize_t len = get_one_line(&in_string, stdin);
-  assert(in_string);
-
   /* We can take advantage of knowing the internal layout of String objects */
+  GcFrame frame;
+  Object *roots[1];
+  cool_gc_push_frame(&frame, roots, 1);
   String *str = String_new();
-  str->val = in_string;
+  roots[0] = (Object *)str;
+
+  /* Get one line worth of input with the newline, if any, discarded */
+  const char *line;
+  size_t n = get_one_line(&line);
+  char *buf = (char *)cool_alloc(n + 1);
+  memcpy(buf, line, n);
+  buf[n] = '\0';
+  str = (String *)roots[0];
+  str->val = buf;
+  str->len = n;
+  str->cap = n + 1;
+  cool_gc_write_barrier((Object *)str, buf);
+  cool_gc_pop_frame(&frame);
   return str;
 }
 
@@ -216,69 +1072,93 @@ int IO_in_int(IO *self) {
   }
 
   /* Get one line worth of input with the newline, if any, discarded */
-  char *in_string = 0;
-  ssize_t len = get_one_line(&in_string, stdin);
-  assert(in_string);
+  const char *p;
+  size_t len = get_one_line(&p);
+  const char *end = p + len;
 
-  /* Now extract initial int and ignore the rest of the line */
-  int x;
-  int num_ints = 0;
-  if (len)
-    /* Discards initial spaces*/
-    num_ints = sscanf(in_string, " %d", &x);
+  /* Now extract initial int in place and ignore the rest of the line */
+  while (p < end && (*p == ' ' || (*p >= '\t' && *p <= '\r')))
+    p++;
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+'))
+    negative = *p++ == '-';
+  const char *digits = p;
+  unsigned x = 0;
+  while (p < end && *p >= '0' && *p <= '9')
+    x = x * 10 + (*p++ - '0');
 
   /* If no text found, abort. */
-  if (num_ints == 0) {
+  if (p == digits) {
     fprintf(stderr,
             "At %s(line %d): Invalid integer on input in IO::in_int()\n",
             __FILE__, __LINE__);
     Object_abort((Object *)self);
   }
-  return x;
+  return negative ? (int)(0u - x) : (int)x;
 }
 
 /*
 // Methods in class Int
 */
 Int *Int_new() {
-  Int *x = (Int *)malloc(sizeof(Int));
-  if (x == 0) {
-    fprintf(stderr, "At %s(line %d): Out of memory\n", __FILE__, __LINE__);
-    Object_abort((Object *)0);
-  }
-  x->vtblptr = &_Int_vtable_prototype;
-  x->val = 0;
-  return x;
+  return (Int *)Object_alloc((const Object_vtable *)&_Int_vtable_prototype);
 }
 
 void Int_init(Int *self, int i) { self->val = i; }
 
+/*
+ * Boxed Ints in [COOL_INT_CACHE_MIN, COOL_INT_CACHE_MAX] are shared, static
+ * objects, so boxing a small counter never allocates. Like the Bool objects
+ * below they live outside the heap and must never be written to; the range
+ * can be changed at build time with -D.
+ */
+#ifndef COOL_INT_CACHE_MIN
+#define COOL_INT_CACHE_MIN (-128)
+#endif
+#ifndef COOL_INT_CACHE_MAX
+#define COOL_INT_CACHE_MAX 1023
+#endif
+
+static Int int_cache[COOL_INT_CACHE_MAX - COOL_INT_CACHE_MIN + 1];
+static Bool bool_objects[2];
+
+static void init_boxes(void) __attribute__((constructor));
+static void init_boxes(void) {
+  for (int i = COOL_INT_CACHE_MIN; i <= COOL_INT_CACHE_MAX; i++) {
+    int_cache[i - COOL_INT_CACHE_MIN].vtblptr = &_Int_vtable_prototype;
+    int_cache[i - COOL_INT_CACHE_MIN].val = i;
+  }
+  for (int b = 0; b < 2; b++) {
+    bool_objects[b].vtblptr = &_Bool_vtable_prototype;
+    bool_objects[b].val = b;
+  }
+}
+
+Int *Int_box(int i) {
+  if (i >= COOL_INT_CACHE_MIN && i <= COOL_INT_CACHE_MAX)
+    return &int_cache[i - COOL_INT_CACHE_MIN];
+  Int *x = Int_new();
+  x->val = i;
+  return x;
+}
+
 /*
 // Methods in class Bool
 */
 Bool *Bool_new() {
-  Bool *b = (Bool *)malloc(sizeof(Bool));
-  if (b == 0) {
-    fprintf(stderr, "At %s(line %d): Out of memory\n", __FILE__, __LINE__);
-    Object_abort((Object *)0);
-  }
-  b->vtblptr = &_Bool_vtable_prototype;
-  b->val = false;
-  return b;
+  return (Bool *)Object_alloc((const Object_vtable *)&_Bool_vtable_prototype);
 }
 
 void Bool_init(Bool *self, bool b) { self->val = b; }
 
+Bool *Bool_box(bool b) { return &bool_objects[b ? 1 : 0]; }
+
 /*
 // Methods in class String
 */
 String *String_new() {
-  String *s = (String *)malloc(sizeof(String));
-  if (s == 0) {
-    fprintf(stderr, "At %s(line %d): Out of memory\n", __FILE__, __LINE__);
-    Object_abort((Object *)0);
-  }
-  s->vtblptr = &_String_vtable_prototype;
+  String *s =
+      (String *)Object_alloc((const Object_vtable *)&_String_vtable_prototype);
   s->val = "";
   return s;
 }
@@ -289,31 +1169,159 @@ int String_length(String *self) {
     abort();
   }
 
-  return strlen(self->val);
+  return self->len;
 }
 
-String *String_concat(String *self, String *s) {
+/*
+ * Concatenations shorter than STRING_ROPE_MIN are copied right away. Longer
+ * ones only record their two halves, so building a string by repeated concat
+ * costs time linear in its length: the bytes are gathered once, by
+ * String_val, when something needs them contiguous. Both halves of a short
+ * concatenation are shorter still, so they are always flat.
+ */
+#define STRING_ROPE_MIN 64
+
+/* The bytes of a String that is not a lazy concatenation */
+static const char *string_bytes(const String *s) {
+  return s->val ? s->val : s->left->val + s->start;
+}
+
+/* Copy the bytes of s into buf, which has room for s->len of them */
+static void gather(String *s, char *buf) {
+  String **stack = 0;
+  size_t top = 0, cap = 0;
+  char *end = buf + s->len;
+  for (;;) {
+    if (s->right == 0) {
+      /* the halves are visited right to left, filling buf from the end */
+      end -= s->len;
+      memcpy(end, string_bytes(s), s->len);
+      if (top == 0)
+        break;
+      s = stack[--top];
+    } else {
+      if (top == cap) {
+        cap = cap ? cap * 2 : 64;
+        stack = (String **)realloc(stack, cap * sizeof(String *));
+        if (stack == 0) {
+          fprintf(stderr, "At %s(line %d): Out of memory\n", __FILE__,
+                  __LINE__);
+          abort();
+        }
+      }
+      stack[top++] = s->left;
+      s = s->right;
+    }
+  }
+  free(stack);
+}
+
+/* Give self its own NUL terminated copy of its bytes */
+static const char *materialize(String *self) {
+  GcFrame frame;
+  Object *roots[1];
+  cool_gc_push_frame(&frame, roots, 1);
+  roots[0] = (Object *)self;
+  char *buf = (char *)cool_alloc(self->len + 1);
+  self = (String *)roots[0];
+  gather(self, buf);
+  buf[self->len] = '\0';
+  self->val = buf;
+  self->cap = self->len + 1;
+  self->left = self->right = 0;
+  cool_gc_write_barrier((Object *)self, buf);
+  cool_gc_pop_frame(&frame);
+  return buf;
+}
+
+const char *String_val(String *self) {
+  if (self == 0) {
+    fprintf(stderr, "At %s(line %d): self is NULL\n", __FILE__, __LINE__);
+    abort();
+  }
+  if (self->right == 0)
+    return string_bytes(self);
+  return materialize(self);
+}
+
+/*
+ * A view ending where its parent ends shares the parent's NUL; any other
+ * view is copied out, once, the first time it is needed as a C string.
+ */
+const char *String_cstr(String *self) {
+  if (self == 0) {
+    fprintf(stderr, "At %s(line %d): self is NULL\n", __FILE__, __LINE__);
+    abort();
+  }
+  if (self->val)
+    return self->val;
+  if (self->right == 0 && self->start + self->len == self->left->len)
+    return self->left->val + self->start;
+  return materialize(self);
+}
+
+bool String_equal(String *self, String *s) {
   if (self == 0 || s == 0) {
     fprintf(stderr, "At %s(line %d): NULL object\n", __FILE__, __LINE__);
     abort();
   }
+  if (self->len != s->len)
+    return false;
 
-  String *s1 = (String *)malloc(sizeof(String));
-  if (s1 == 0) {
-    fprintf(stderr, "At %s(line %d): Out of memory\n", __FILE__, __LINE__);
-    Object_abort((Object *)0);
+  /* flattening one side may move the other's bytes, so fetch both after */
+  GcFrame frame;
+  Object *roots[2];
+  cool_gc_push_frame(&frame, roots, 2);
+  roots[0] = (Object *)self;
+  roots[1] = (Object *)s;
+  String_val(self);
+  String_val((String *)roots[1]);
+  self = (String *)roots[0];
+  s = (String *)roots[1];
+  bool eq = memcmp(string_bytes(self), string_bytes(s), s->len) == 0;
+  cool_gc_pop_frame(&frame);
+  return eq;
+}
+
+String *String_concat(String *self, String *s) {
+  if (self == 0 || s == 0) {
+    fprintf(stderr, "At %s(line %d): NULL object\n", __FILE__, __LINE__);
+    abort();
   }
-  s1->vtblptr = &_String_vtable_prototype;
 
-  char *cats = (char *)malloc(strlen(self->val) + strlen(s->val) + 1);
-  if (cats == 0) {
-    fprintf(stderr, "At %s(line %d): Out of memory\n", __FILE__, __LINE__);
-    Object_abort((Object *)0);
+  /* The result is allocated before its bytes, so everything stays rooted */
+  GcFrame frame;
+  Object *roots[3];
+  cool_gc_push_frame(&frame, roots, 3);
+  roots[0] = (Object *)self;
+  roots[1] = (Object *)s;
+  roots[2] = (Object *)String_new();
+  self = (String *)roots[0];
+  s = (String *)roots[1];
+  String *s1 = (String *)roots[2];
+  int len = self->len + s->len;
+  s1->len = len;
+
+  if (len >= STRING_ROPE_MIN) {
+    s1->val = 0;
+    s1->left = self;
+    s1->right = s;
+    cool_gc_write_barrier((Object *)s1, self);
+    cool_gc_write_barrier((Object *)s1, s);
+  } else {
+    char *cats = (char *)cool_alloc(len + 1);
+    self = (String *)roots[0];
+    s = (String *)roots[1];
+    s1 = (String *)roots[2];
+    memcpy(cats, string_bytes(self), self->len);
+    memcpy(cats + self->len, string_bytes(s), s->len);
+    cats[len] = '\0';
+    s1->val = cats;
+    s1->cap = len + 1;
+    cool_gc_write_barrier((Object *)s1, cats);
   }
-  strcpy(cats, self->val);
-  strcat(cats, s->val);
-  s1->val = cats;
 
+  cool_gc_pop_frame(&frame);
   return s1;
 }
 
@@ -323,28 +1331,31 @@ String *String_substr(String *self, int i, int l) {
     abort();
   }
 
-  int len = strlen(self->val);
-  if (i >= len || i + l - 1 >= len) {
+  int len = self->len;
+  if (i < 0 || l < 0 || i >= len || i + l - 1 >= len) {
     fprintf(stderr, "At %s(line %d): Substring out of range\n", __FILE__,
             __LINE__);
     Object_abort((Object *)0);
   }
 
-  String *s1 = (String *)malloc(sizeof(String));
-  if (s1 == 0) {
-    fprintf(stderr, "At %s(line %d): Out of memory\n", __FILE__, __LINE__);
-    Object_abort((Object *)0);
-  }
-  s1->vtblptr = &_String_vtable_prototype;
-
-  char *subs = (char *)malloc(l + 1);
-  if (subs == 0) {
-    fprintf(stderr, "At %s(line %d): Out of memory\n", __FILE__, __LINE__);
-    Object_abort((Object *)0);
+  /* The result is a view of the bytes; only a concatenation is flattened */
+  GcFrame frame;
+  Object *roots[1];
+  cool_gc_push_frame(&frame, roots, 1);
+  roots[0] = (Object *)self;
+  String_val(self);
+  String *s1 = String_new();
+  self = (String *)roots[0];
+  if (self->val == 0) {
+    i += self->start;
+    self = self->left;
   }
-  strncpy(subs, &(self->val[i]), l);
-  subs[l] = '\0';
-  s1->val = subs;
+  s1->val = 0;
+  s1->left = self;
+  s1->start = i;
+  s1->len = l;
+  cool_gc_write_barrier((Object *)s1, self);
 
+  cool_gc_pop_frame(&frame);
   return s1;
 }
@@ -6,6 +6,10 @@
 
 #include <stdbool.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct Object Object;
 typedef struct Int Int;
 typedef struct Bool Bool;
@@ -18,6 +22,8 @@ typedef struct _Bool_vtable Bool_vtable;
 typedef struct _String_vtable String_vtable;
 typedef struct _IO_vtable IO_vtable;
 
+typedef struct GcFrame GcFrame;
+
 /* class type definitions */
 struct Object {
   const Object_vtable *vtblptr;
@@ -33,20 +39,50 @@ struct Bool {
   bool val;
 };
 
+/*
+ * A String whose val is NULL has no bytes of its own. If right is set it is
+ * a lazy concatenation: its bytes are those of left followed by those of
+ * right. Otherwise it is a view of len bytes starting at byte start of left,
+ * which is always a String with its own val.
+ *
+ * Use String_val() to get the len contiguous bytes of any String, and
+ * String_cstr() where they must also be NUL terminated.
+ */
 struct String {
   const String_vtable *vtblptr;
   const char *val;
+  int len; /* bytes at val, not counting any NUL */
+  union {
+    int cap;   /* heap bytes owned at val, 0 for static data */
+    int start; /* offset into left, for a view */
+  };
+  String *left;
+  String *right;
 };
 
 struct IO {
   const IO_vtable *vtblptr;
 };
 
+/*
+ * A shadow stack frame. Generated methods push one on entry, keep every live
+ * object reference in its roots, and pop it before returning. The collector
+ * moves young objects, so a reference must be reloaded from its root after
+ * anything that can allocate.
+ */
+struct GcFrame {
+  GcFrame *prev;
+  int num_roots;
+  Object **roots;
+};
+
 /* vtable type definitions */
 struct _Object_vtable {
   int tag;
   int size;
+  int size_class; /* block size in 8 byte units, header included; 0 if unset */
   const char *name;
+  const String *name_string; /* what type_name() returns */
 
   Object *(*abort_object)(Object *self);
   String *(*type_name_object)(Object *self);
@@ -56,7 +92,9 @@ struct _Object_vtable {
 struct _Int_vtable {
   int tag;
   int size;
+  int size_class; /* block size in 8 byte units, header included; 0 if unset */
   const char *name;
+  const String *name_string; /* what type_name() returns */
 
   Object *(*abort_int)(Object *self);
   String *(*type_name_int)(Object *self);
@@ -66,7 +104,9 @@ struct _Int_vtable {
 struct _Bool_vtable {
   int tag;
   int size;
+  int size_class; /* block size in 8 byte units, header included; 0 if unset */
   const char *name;
+  const String *name_string; /* what type_name() returns */
 
   Object *(*abort_bool)(Object *self);
   String *(*type_name_bool)(Object *self);
@@ -76,7 +116,9 @@ struct _Bool_vtable {
 struct _String_vtable {
   int tag;
   int size;
+  int size_class; /* block size in 8 byte units, header included; 0 if unset */
   const char *name;
+  const String *name_string; /* what type_name() returns */
 
   Object *(*abort_string)(Object *self);
   String *(*type_name_string)(Object *self);
@@ -89,7 +131,9 @@ struct _String_vtable {
 struct _IO_vtable {
   int tag;
   int size;
+  int size_class; /* block size in 8 byte units, header included; 0 if unset */
   const char *name;
+  const String *name_string; /* what type_name() returns */
 
   Object *(*abort_io)(Object *self);
   String *(*type_name_io)(Object *self);
@@ -100,13 +144,30 @@ struct _IO_vtable {
   int (*in_int_io)(IO *self);
 };
 
-/* Class vtable prototypes */
+/* Class vtable prototypes, emitted by cgen */
 extern const Object_vtable _Object_vtable_prototype;
 extern const Int_vtable _Int_vtable_prototype;
 extern const Bool_vtable _Bool_vtable_prototype;
 extern const String_vtable _String_vtable_prototype;
 extern const IO_vtable _IO_vtable_prototype;
 
+/*
+ * Pointer maps emitted by cgen, indexed by class tag. A map lists the byte
+ * offsets of the object-valued attributes of its class and ends with -1.
+ * Basic classes have no entry. Without the table the collector stays off.
+ */
+extern const int *const _ptrmap_table[] __attribute__((weak));
+
+/* runtime allocation */
+void *cool_alloc(int size);
+Object *Object_alloc(const Object_vtable *vtbl);
+
+/* garbage collection */
+void cool_gc_push_frame(GcFrame *frame, Object **roots, int num_roots);
+void cool_gc_pop_frame(GcFrame *frame);
+void cool_gc_write_barrier(Object *obj, const void *val);
+void cool_gc_collect(void);
+
 /* methods in class Object */
 Object *Object_new(void);
 Object *Object_abort(Object *self);
@@ -116,16 +177,21 @@ Object *Object_copy(Object *self);
 /* methods in class Int */
 Int *Int_new(void);
 void Int_init(Int *self, int i);
+Int *Int_box(int i);
 
 /* methods in class Bool */
 Bool *Bool_new(void);
 void Bool_init(Bool *self, bool b);
+Bool *Bool_box(bool b);
 
 /* methods in class String */
 String *String_new(void);
 int String_length(String *self);
 String *String_concat(String *self, String *s);
 String *String_substr(String *self, int i, int l);
+const char *String_val(String *self);
+const char *String_cstr(String *self);
+bool String_equal(String *self, String *s);
 
 /* methods in class IO */
 IO *IO_new(void);
@@ -133,3 +199,7 @@ IO *IO_out_string(IO *self, String *s);
 IO *IO_out_int(IO *self, int x);
 String *IO_in_string(IO *self);
 int IO_in_int(IO *self);
+
+#ifdef __cplusplus
+}
+#endif
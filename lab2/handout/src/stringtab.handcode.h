@@ -12,9 +12,13 @@ class CgenClassTable;
   void code_ref(std::ostream &str, CgenClassTable *classTable);                \
 
 #define IntEntry_EXTRAS                                                        \
+  void code_def(std::ostream &str, CgenClassTable *classTable);                \
   void code_ref(std::ostream &str, CgenClassTable *classTable);
 
 #define StrTable_EXTRAS                                                        \
   void code_string_table(std::ostream &, CgenClassTable *classTable);
 
+#define IntTable_EXTRAS                                                        \
+  void code_int_table(std::ostream &, CgenClassTable *classTable);
+
 #endif /* STRINGTAB_HANDCODE_H */
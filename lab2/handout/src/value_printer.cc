@@ -86,22 +86,22 @@ void ValuePrinter::init_ext_constant(std::string name, op_type type) {
 }
 
 /* Function definition
- * Format: define return_type function_name(args) {
+ * Format: define return_type function_name(args) [attrs] {
  * Note: Must terminate the function definition with a "}" or by using
  * end_define() after printing all the instructions in a function body.
  */
 void ValuePrinter::define(std::ostream &o, op_type ret_type, std::string name,
-                          std::vector<operand> args) {
+                          std::vector<operand> args, std::string attrs) {
   check_ostream(o);
   o << "define " + ret_type.get_name() + " @" + name + "(";
   for (unsigned i = 0; i < args.size(); ++i)
     o << args[i].get_typename() + " " + args[i].get_name() +
              (i + 1 < args.size() ? ", " : "");
-  o << ") {\n";
+  o << ")" + (attrs.empty() ? "" : " " + attrs) + " {\n";
 }
 void ValuePrinter::define(op_type ret_type, std::string name,
-                          std::vector<operand> args) {
-  define(*stream, ret_type, name, args);
+                          std::vector<operand> args, std::string attrs) {
+  define(*stream, ret_type, name, args, attrs);
 }
 
 /* Function declaration
@@ -278,6 +278,15 @@ void ValuePrinter::alloca_mem(std::ostream &o, op_type type, operand result) {
   check_ostream(o);
   o << "\t" + result.get_name() + " = alloca " + type.get_name() + "\n";
 }
+/* Array allocation
+ * Format: result = alloca type, i32 count
+ */
+void ValuePrinter::alloca_mem(std::ostream &o, op_type type, int count,
+                              operand result) {
+  check_ostream(o);
+  o << "\t" + result.get_name() + " = alloca " + type.get_name() + ", i32 " +
+           std::to_string(count) + "\n";
+}
 operand ValuePrinter::alloca_mem(op_type type) {
   operand result = make_fresh_operand(type.get_ptr_type());
   alloca_mem(*stream, type, result);
@@ -450,6 +459,25 @@ operand ValuePrinter::select(operand op1, operand op2, operand op3) {
   return result;
 }
 
+/* phi instruction
+ * Format: result = phi op_type [op1_name, %label1], [op2_name, %label2], ...
+ */
+void ValuePrinter::phi(std::ostream &o, std::vector<operand> ops,
+                       std::vector<label> labels, operand result) {
+  check_ostream(o);
+  assert(ops.size() == labels.size() && ops.size() > 0);
+  o << "\t" + result.get_name() + " = phi " + ops[0].get_typename() + " ";
+  for (unsigned i = 0; i < ops.size(); ++i)
+    o << "[" + ops[i].get_name() + ", %" + labels[i] + "]" +
+             (i + 1 < ops.size() ? ", " : "");
+  o << "\n";
+}
+operand ValuePrinter::phi(std::vector<operand> ops, std::vector<label> labels) {
+  operand result = make_fresh_operand(ops[0].get_type());
+  phi(*stream, ops, labels, result);
+  return result;
+}
+
 /* Conditional branch instruction
  * Format: br op_type op_value, label %true_label, label %false_label
  */
@@ -464,6 +492,28 @@ void ValuePrinter::branch_cond(operand op, label label_true,
   branch_cond(*stream, op, label_true, label_false);
 }
 
+/* Switch instruction
+ * Format: switch op_type op_value, label %default [ op_type val1, label %label1
+ *         op_type val2, label %label2 ... ]
+ */
+void ValuePrinter::switch_inst(std::ostream &o, operand op, label default_label,
+                               std::vector<const_value> vals,
+                               std::vector<label> labels) {
+  check_ostream(o);
+  assert(vals.size() == labels.size());
+  o << "\tswitch " + op.get_typename() + " " + op.get_name() + ", label %" +
+           default_label + " [";
+  for (unsigned i = 0; i < vals.size(); ++i)
+    o << " " + vals[i].get_typename() + " " + vals[i].get_name() +
+             ", label %" + labels[i];
+  o << " ]\n";
+}
+void ValuePrinter::switch_inst(operand op, label default_label,
+                               std::vector<const_value> vals,
+                               std::vector<label> labels) {
+  switch_inst(*stream, op, default_label, vals, labels);
+}
+
 /* Unconditional branch instruction
  * Format: br label %label_name
  */
@@ -51,8 +51,9 @@ public:
                std::vector<op_type> args);
   void declare(op_type ret_type, std::string name, std::vector<op_type> args);
   void define(std::ostream &o, op_type ret_type, std::string name,
-              std::vector<operand> args);
-  void define(op_type ret_type, std::string name, std::vector<operand> args);
+              std::vector<operand> args, std::string attrs = "");
+  void define(op_type ret_type, std::string name, std::vector<operand> args,
+              std::string attrs = "");
   void end_define(std::ostream &o) {
     check_ostream(o);
     o << "}\n\n";
@@ -97,6 +98,7 @@ public:
   void malloc_mem(std::ostream &o, int size, operand result);
   void malloc_mem(std::ostream &o, operand size, operand result);
   void alloca_mem(std::ostream &o, op_type type, operand op2);
+  void alloca_mem(std::ostream &o, op_type type, int count, operand op2);
   void load(std::ostream &o, op_type type, operand op, operand op2);
   void store(std::ostream &o, operand op, operand op2);
   void getelementptr(std::ostream &o, op_type type, operand op1, operand op2,
@@ -135,6 +137,8 @@ public:
   void branch_cond(std::ostream &o, operand op, label label_true,
                    label label_false);
   void branch_uncond(std::ostream &o, std::string label);
+  void switch_inst(std::ostream &o, operand op, label default_label,
+                   std::vector<const_value> vals, std::vector<label> labels);
   void ret(std::ostream &o, operand op);
   void unreachable(std::ostream &o) {
     check_ostream(o);
@@ -143,12 +147,16 @@ public:
 
   void branch_cond(operand op, label label_true, label label_false);
   void branch_uncond(std::string label);
+  void switch_inst(operand op, label default_label,
+                   std::vector<const_value> vals, std::vector<label> labels);
   void ret(operand op);
   void unreachable() { unreachable(*stream); }
 
   /* Other operations */
   void select(std::ostream &o, operand op1, operand op2, operand op3,
               operand result);
+  void phi(std::ostream &o, std::vector<operand> ops, std::vector<label> labels,
+           operand result);
   void icmp(std::ostream &o, icmp_val v, operand op1, operand op2,
             operand result);
   void call(std::ostream &o, std::vector<op_type> arg_types,
@@ -158,6 +166,7 @@ public:
   void ptrtoint(std::ostream &o, operand op, op_type new_type, operand result);
 
   operand select(operand op1, operand op2, operand op3);
+  operand phi(std::vector<operand> ops, std::vector<label> labels);
   operand icmp(icmp_val v, operand op1, operand op2);
   operand call(std::vector<op_type> arg_types, op_type result_type,
                std::string fn_name, bool is_global, std::vector<operand> args);
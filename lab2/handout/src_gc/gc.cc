@@ -1,18 +1,799 @@
 #include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <mutex>
-#include <unordered_map>
+#include <ctime>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <link.h>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
 
-// Global variable to track whether we are in the middle of a malloc/calloc/free
-static std::mutex mtx;
-static std::unordered_map<void *, size_t> allocs;
+// Live blocks are kept in an open-addressing table keyed by pointer. Slots
+// are claimed and released with atomics, so a block may be freed by a
+// different thread than the one that allocated it. A freed slot becomes a
+// tombstone that the next insert probing through it reuses. Once live blocks
+// and tombstones fill three quarters of the slots, the table is rebuilt
+// without the tombstones, at twice the size if live blocks alone fill half of
+// it. Every lookup holds a shared count on the table, which the rebuild waits
+// to drain, so malloc and free only ever wait for a rebuild. The table lives
+// in its own mapping so that growing it never recurses into malloc;
+// GC_TABLE_BITS sets its initial size.
+#define EMPTY_KEY ((uintptr_t)0)
+#define TOMBSTONE_KEY ((uintptr_t)1)
+#define DEFAULT_TABLE_BITS 16
+#define MAX_TABLE_BITS 32 // mark stack entries are 32-bit slot indexes
+// Probe sequences are cut off here, so an insert that cannot find a free slot
+// grows the table rather than sweeping every slot
+#define MAX_PROBES 4096
+
+struct Slot {
+  std::atomic<uintptr_t> key;
+  std::atomic<size_t> size;
+  std::atomic<uint32_t> stack; // 1 + index into stacks, 0 if not sampled
+};
+
+static Slot *table = nullptr;
+static size_t table_mask = 0;
+static int table_shift = 64;
+static size_t max_probes = 0;
+static std::atomic<size_t> table_used(0); // slots that are not empty
+static std::atomic<size_t> table_live(0); // slots holding a block
+// Threads inside a table operation, with REBUILDING set during a rebuild
+static std::atomic<uint32_t> table_users(0);
+#define REBUILDING (1u << 31)
+static std::atomic<size_t> dropped(0); // inserts the table could not grow for
+
+// Tracking is on between before_main and after_main
 static std::atomic<bool> activated(false);
+// Set while this thread is inside a hook, so that allocations made by the
+// hook itself (fprintf, for one) are not tracked
+static thread_local bool in_hook __attribute__((tls_model("initial-exec"))) =
+    false;
 static bool print_malloc = false;
 
 #define print_if_enabled(...) { if (print_malloc) { fprintf(stderr, __VA_ARGS__); } }
 
+// With GC_SAMPLE_BYTES=N set, roughly one allocation per N bytes allocated
+// by a thread has its backtrace taken, like a byte-sampling heap profiler.
+// Sampled blocks are charged to their call stack until they are freed, and
+// the report at exit lists live bytes by stack and by Cool class.
+#define MAX_STACKS 4096
+#define MAX_DEPTH 16
+#define SKIP_FRAMES 2 // record_sample and the hook itself
+
+struct Stack {
+  uint64_t hash;
+  int depth;
+  void *frames[MAX_DEPTH];
+  std::atomic<size_t> live_bytes;
+  std::atomic<size_t> live_count;
+  std::atomic<size_t> samples;
+};
+
+static Stack stacks[MAX_STACKS];
+static std::atomic<uint32_t> num_stacks(0);
+static std::atomic_flag stacks_lock = ATOMIC_FLAG_INIT;
+static long sample_interval = 0; // 0: sampling is off
+static thread_local long bytes_until_sample
+    __attribute__((tls_model("initial-exec"))) = 0;
+
+// Find or add the stack for frames; 0 if the stack table is full
+static uint32_t intern_stack(void **frames, int depth) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (int i = 0; i < depth; i++) {
+    hash = (hash ^ (uintptr_t)frames[i]) * 0x100000001b3ull;
+  }
+
+  while (stacks_lock.test_and_set(std::memory_order_acquire)) {
+  }
+  uint32_t n = num_stacks.load(std::memory_order_relaxed), id = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    if (stacks[i].hash == hash && stacks[i].depth == depth &&
+        memcmp(stacks[i].frames, frames, depth * sizeof(void *)) == 0) {
+      id = i + 1;
+      break;
+    }
+  }
+  if (id == 0 && n < MAX_STACKS) {
+    stacks[n].hash = hash;
+    stacks[n].depth = depth;
+    memcpy(stacks[n].frames, frames, depth * sizeof(void *));
+    num_stacks.store(n + 1, std::memory_order_release);
+    id = n + 1;
+  }
+  stacks_lock.clear(std::memory_order_release);
+  return id;
+}
+
+// Decide whether this allocation is sampled, and if so charge it to its stack.
+// Not inlined, so that its frame is always one of the SKIP_FRAMES.
+static uint32_t __attribute__((noinline)) record_sample(size_t size) {
+  if (sample_interval == 0) {
+    return 0;
+  }
+  bytes_until_sample -= size;
+  if (bytes_until_sample > 0) {
+    return 0;
+  }
+  bytes_until_sample = sample_interval;
+
+  void *frames[MAX_DEPTH + SKIP_FRAMES];
+  int depth = backtrace(frames, MAX_DEPTH + SKIP_FRAMES) - SKIP_FRAMES;
+  if (depth <= 0) {
+    return 0;
+  }
+  uint32_t id = intern_stack(frames + SKIP_FRAMES, depth);
+  if (id) {
+    stacks[id - 1].live_bytes += size;
+    stacks[id - 1].live_count++;
+    stacks[id - 1].samples++;
+  }
+  return id;
+}
+
+static void release_sample(uint32_t id, size_t size) {
+  if (id) {
+    stacks[id - 1].live_bytes -= size;
+    stacks[id - 1].live_count--;
+  }
+}
+
+// A block is taken to be a Cool object if its first word points into the
+// program image at something laid out like a vtable: the class name is a
+// pointer into the image at a capitalized identifier. The name follows tag
+// and size in the reference runtime, and also size_class in ours.
+struct Image {
+  uintptr_t lo[8], hi[8];
+  int n;
+};
+
+static int find_program_image(struct dl_phdr_info *info, size_t, void *data) {
+  Image *image = (Image *)data;
+  for (int i = 0; i < info->dlpi_phnum && image->n < 8; i++) {
+    if (info->dlpi_phdr[i].p_type == PT_LOAD) {
+      uintptr_t lo = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+      image->lo[image->n] = lo;
+      image->hi[image->n] = lo + info->dlpi_phdr[i].p_memsz;
+      image->n++;
+    }
+  }
+  return 1; // the program comes first; skip the shared objects
+}
+
+static bool in_image(const Image &image, uintptr_t p, size_t len) {
+  for (int i = 0; i < image.n; i++) {
+    if (p >= image.lo[i] && p + len <= image.hi[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static const char *cool_class_name(const Image &image, uintptr_t block,
+                                   size_t size) {
+  if (size < sizeof(void *)) {
+    return nullptr;
+  }
+  uintptr_t vtbl = *(uintptr_t *)block;
+  if (vtbl % sizeof(void *) != 0 || !in_image(image, vtbl, 24)) {
+    return nullptr;
+  }
+  for (size_t offset : {8, 16}) {
+    uintptr_t name = *(uintptr_t *)(vtbl + offset);
+    if (!in_image(image, name, 1) || !isupper(*(const char *)name)) {
+      continue;
+    }
+    for (size_t i = 1; i < 64 && in_image(image, name + i, 1); i++) {
+      char c = ((const char *)name)[i];
+      if (c == '\0') {
+        return (const char *)name;
+      }
+      if (!isalnum(c) && c != '_') {
+        break;
+      }
+    }
+  }
+  return nullptr;
+}
+
+#define MAX_CLASSES 256
+
+static void print_profile(void) {
+  fprintf(stderr, "gc.so: heap profile, one sample per %ld bytes\n",
+          sample_interval);
+
+  // Sampled stacks that still hold live blocks, most live bytes first
+  uint32_t n = num_stacks.load(std::memory_order_acquire);
+  static bool printed[MAX_STACKS];
+  for (;;) {
+    uint32_t best = MAX_STACKS;
+    for (uint32_t i = 0; i < n; i++) {
+      if (!printed[i] && stacks[i].live_count > 0 &&
+          (best == MAX_STACKS ||
+           stacks[i].live_bytes > stacks[best].live_bytes)) {
+        best = i;
+      }
+    }
+    if (best == MAX_STACKS) {
+      break;
+    }
+    printed[best] = true;
+    fprintf(stderr, "stack: %zu live bytes in %zu blocks (%zu samples)\n",
+            stacks[best].live_bytes.load(), stacks[best].live_count.load(),
+            stacks[best].samples.load());
+    backtrace_symbols_fd(stacks[best].frames, stacks[best].depth,
+                         STDERR_FILENO);
+  }
+
+  // Every live block, by class
+  Image image = {};
+  dl_iterate_phdr(find_program_image, &image);
+  static const char *names[MAX_CLASSES];
+  static size_t class_bytes[MAX_CLASSES], class_count[MAX_CLASSES];
+  int num_classes = 0;
+  for (size_t i = 0; i <= table_mask; i++) {
+    uintptr_t key = table[i].key.load(std::memory_order_acquire);
+    if (key == EMPTY_KEY || key == TOMBSTONE_KEY) {
+      continue;
+    }
+    size_t size = table[i].size.load(std::memory_order_acquire);
+    const char *name = cool_class_name(image, key, size);
+    if (!name) {
+      name = "(not an object)";
+    }
+    int c = 0;
+    while (c < num_classes && strcmp(names[c], name) != 0) {
+      c++;
+    }
+    if (c == num_classes) {
+      if (num_classes == MAX_CLASSES) {
+        continue;
+      }
+      names[num_classes++] = name;
+    }
+    class_bytes[c] += size;
+    class_count[c]++;
+  }
+  for (int c = 0; c < num_classes; c++) {
+    fprintf(stderr, "class %s: %zu live bytes in %zu blocks\n", names[c],
+            class_bytes[c], class_count[c]);
+  }
+}
+
+// Heap totals, kept for every tracked block. With GC_TRACE=path set, a CSV
+// row of them is appended to path every GC_TRACE_EVERY allocations (default
+// 1000) and, if GC_TRACE_MS is set, whenever that many milliseconds have
+// passed since the last row. A last row is written at exit.
+static std::atomic<size_t> live_bytes(0), peak_bytes(0);
+static std::atomic<size_t> alloc_count(0), free_count(0);
+static std::atomic<size_t> total_bytes(0);
+// Allocations by size class: class k holds sizes in (2^(k-1), 2^k]
+#define NUM_SIZE_CLASSES 48
+static std::atomic<size_t> class_allocs[NUM_SIZE_CLASSES];
+static int trace_fd = -1;
+static size_t trace_every = 1000;
+static long trace_ns = 0; // 0: no time-based rows
+static std::atomic<long> next_trace_ns(0);
+static long start_ns = 0;
+
+static long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void write_trace_row(long now) {
+  char row[128];
+  int len = snprintf(row, sizeof(row), "%ld,%zu,%zu,%zu,%zu\n",
+                     (now - start_ns) / 1000, alloc_count.load(),
+                     free_count.load(), live_bytes.load(), peak_bytes.load());
+  if (write(trace_fd, row, len) != len) {
+    trace_fd = -1;
+  }
+}
+
+static int size_class(size_t size) {
+  int k = size <= 1 ? 0 : 64 - __builtin_clzl(size - 1);
+  return k < NUM_SIZE_CLASSES ? k : NUM_SIZE_CLASSES - 1;
+}
+
+static void note_alloc(size_t size) {
+  size_t n = alloc_count.fetch_add(1, std::memory_order_relaxed) + 1;
+  total_bytes.fetch_add(size, std::memory_order_relaxed);
+  class_allocs[size_class(size)].fetch_add(1, std::memory_order_relaxed);
+  size_t live = live_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+  size_t peak = peak_bytes.load(std::memory_order_relaxed);
+  while (live > peak && !peak_bytes.compare_exchange_weak(peak, live)) {
+  }
+  if (trace_fd < 0) {
+    return;
+  }
+  if (n % trace_every == 0) {
+    write_trace_row(now_ns());
+  } else if (trace_ns) {
+    long now = now_ns(), next = next_trace_ns.load(std::memory_order_relaxed);
+    if (now >= next &&
+        next_trace_ns.compare_exchange_strong(next, now + trace_ns)) {
+      write_trace_row(now);
+    }
+  }
+}
+
+static void note_free(size_t size) {
+  free_count.fetch_add(1, std::memory_order_relaxed);
+  live_bytes.fetch_sub(size, std::memory_order_relaxed);
+}
+
+static size_t slot_index(void *ptr) {
+  return (((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ull) >> table_shift;
+}
+
+static void enter_table(void) {
+  uint32_t users = table_users.load(std::memory_order_relaxed);
+  for (;;) {
+    if (users & REBUILDING) {
+      users = table_users.load(std::memory_order_relaxed);
+    } else if (table_users.compare_exchange_weak(users, users + 1,
+                                                 std::memory_order_acquire)) {
+      return;
+    }
+  }
+}
+
+static void leave_table(void) {
+  table_users.fetch_sub(1, std::memory_order_release);
+}
+
+static Slot *map_slots(size_t slots) {
+  void *mem = mmap(nullptr, slots * sizeof(Slot), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return mem == MAP_FAILED ? nullptr : (Slot *)mem;
+}
+
+static void use_slots(Slot *slots, size_t count) {
+  table = slots;
+  table_mask = count - 1;
+  table_shift = 64 - __builtin_ctzl(count);
+  max_probes = count < MAX_PROBES ? count : MAX_PROBES;
+}
+
+static bool resize_marks(size_t slots);
+
+// Rebuild the table without its tombstones, at twice the size if grow is set
+// or live blocks fill half of it. Returns false if the new table cannot be
+// mapped. If another thread is already rebuilding, wait for it instead.
+static bool rebuild_table(bool grow) {
+  uint32_t users = table_users.fetch_or(REBUILDING, std::memory_order_acquire);
+  if (users & REBUILDING) {
+    while (table_users.load(std::memory_order_acquire) & REBUILDING) {
+    }
+    return true;
+  }
+  while (table_users.load(std::memory_order_acquire) != REBUILDING) {
+  }
+
+  size_t slots = table_mask + 1, live = table_live.load();
+  bool rebuilt = true;
+  // Someone else may have rebuilt since the caller looked
+  if (grow || table_used.load() > slots / 4 * 3) {
+    size_t new_slots = slots;
+    if ((grow || live > slots / 2) && slots < ((size_t)1 << MAX_TABLE_BITS)) {
+      new_slots = slots * 2;
+    }
+    Slot *old = table, *fresh = map_slots(new_slots);
+    if (!fresh || (grow && new_slots == slots) || !resize_marks(new_slots)) {
+      if (fresh) {
+        munmap(fresh, new_slots * sizeof(Slot));
+      }
+      rebuilt = false;
+    } else {
+      use_slots(fresh, new_slots);
+      for (size_t i = 0; i < slots; i++) {
+        uintptr_t key = old[i].key.load(std::memory_order_relaxed);
+        if (key == EMPTY_KEY || key == TOMBSTONE_KEY) {
+          continue;
+        }
+        size_t j = slot_index((void *)key);
+        while (table[j & table_mask].key.load(std::memory_order_relaxed) !=
+               EMPTY_KEY) {
+          j++;
+        }
+        Slot &slot = table[j & table_mask];
+        slot.key.store(key, std::memory_order_relaxed);
+        slot.size.store(old[i].size.load(std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+        slot.stack.store(old[i].stack.load(std::memory_order_relaxed),
+                         std::memory_order_relaxed);
+      }
+      table_used.store(live);
+      munmap(old, slots * sizeof(Slot));
+    }
+  }
+  table_users.fetch_and(~REBUILDING, std::memory_order_release);
+  return rebuilt;
+}
+
+static void table_insert(void *ptr, size_t size, uint32_t stack) {
+  for (;;) {
+    enter_table();
+    size_t i = slot_index(ptr), limit = (table_mask + 1) / 4 * 3;
+    for (size_t probes = 0; probes < max_probes; probes++, i++) {
+      Slot &slot = table[i & table_mask];
+      uintptr_t key = slot.key.load(std::memory_order_relaxed);
+      while (key == EMPTY_KEY || key == TOMBSTONE_KEY) {
+        if (slot.key.compare_exchange_weak(key, (uintptr_t)ptr,
+                                           std::memory_order_acq_rel)) {
+          slot.size.store(size, std::memory_order_release);
+          slot.stack.store(stack, std::memory_order_release);
+          table_live.fetch_add(1, std::memory_order_relaxed);
+          size_t used = key == EMPTY_KEY ? table_used.fetch_add(1) + 1
+                                         : table_used.load();
+          leave_table();
+          if (used > limit) {
+            rebuild_table(false);
+          }
+          return;
+        }
+      }
+    }
+    leave_table();
+    if (!rebuild_table(true)) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+  }
+}
+
+// Remove ptr and return its size and stack, or return false if it is not
+// tracked
+static bool table_erase(void *ptr, size_t *size, uint32_t *stack) {
+  enter_table();
+  size_t i = slot_index(ptr);
+  bool found = false;
+  for (size_t probes = 0; probes < max_probes; probes++, i++) {
+    Slot &slot = table[i & table_mask];
+    uintptr_t key = slot.key.load(std::memory_order_acquire);
+    if (key == (uintptr_t)ptr) {
+      *size = slot.size.load(std::memory_order_acquire);
+      *stack = slot.stack.load(std::memory_order_acquire);
+      slot.key.store(TOMBSTONE_KEY, std::memory_order_release);
+      table_live.fetch_sub(1, std::memory_order_relaxed);
+      found = true;
+      break;
+    }
+    if (key == EMPTY_KEY) {
+      break;
+    }
+  }
+  leave_table();
+  return found;
+}
+
+// Buffers the C library allocates for itself and keeps until exit. They are
+// not leaks, and are reported apart from them.
+static const char *allowed_buffer(uintptr_t block) {
+  static const struct {
+    const char *name;
+    FILE **file;
+  } buffers[] = {{"stdin", &stdin}, {"stdout", &stdout}, {"stderr", &stderr}};
+  for (auto &buffer : buffers) {
+    if ((uintptr_t)(*buffer.file)->_IO_buf_base == block) {
+      return buffer.name;
+    }
+  }
+  return nullptr;
+}
+
+// Leaks grouped by class and size, the order they are reported in
+struct LeakGroup {
+  const char *name; // null if the block is not a Cool object
+  size_t size;
+  size_t count;
+};
+
+static int compare_leak_groups(const void *a, const void *b) {
+  const LeakGroup *x = (const LeakGroup *)a, *y = (const LeakGroup *)b;
+  int names = strcmp(x->name ? x->name : "", y->name ? y->name : "");
+  if (names != 0) {
+    return names;
+  }
+  return x->size < y->size ? -1 : x->size > y->size;
+}
+
+#define MAX_LEAK_GROUPS 1024
+
+// The GC_REPORT=json report. Everything in it is independent of addresses
+// and timing, so reports from two builds of a program can be diffed.
+static void print_json_report(FILE *out) {
+  Image image = {};
+  dl_iterate_phdr(find_program_image, &image);
+  static LeakGroup groups[MAX_LEAK_GROUPS];
+  static size_t class_live[NUM_SIZE_CLASSES];
+  int num_groups = 0;
+  size_t leaked_blocks = 0, leaked_bytes = 0;
+
+  fprintf(out, "{\n  \"allowed\": [");
+  const char *sep = "";
+  for (size_t i = 0; i <= table_mask; i++) {
+    uintptr_t key = table[i].key.load(std::memory_order_acquire);
+    if (key == EMPTY_KEY || key == TOMBSTONE_KEY) {
+      continue;
+    }
+    size_t size = table[i].size.load(std::memory_order_acquire);
+    class_live[size_class(size)]++;
+    if (const char *buffer = allowed_buffer(key)) {
+      fprintf(out, "%s{\"buffer\": \"%s\", \"size\": %zu}", sep, buffer,
+              size);
+      sep = ", ";
+      continue;
+    }
+    leaked_blocks++;
+    leaked_bytes += size;
+    const char *name = cool_class_name(image, key, size);
+    int g = 0;
+    while (g < num_groups &&
+           (groups[g].name != name || groups[g].size != size)) {
+      g++;
+    }
+    if (g == num_groups) {
+      if (num_groups == MAX_LEAK_GROUPS) {
+        continue;
+      }
+      groups[num_groups++] = {name, size, 0};
+    }
+    groups[g].count++;
+  }
+  fprintf(out, "],\n");
+
+  fprintf(out, "  \"allocs\": %zu,\n  \"frees\": %zu,\n", alloc_count.load(),
+          free_count.load());
+  fprintf(out, "  \"total_bytes\": %zu,\n  \"peak_bytes\": %zu,\n",
+          total_bytes.load(), peak_bytes.load());
+  fprintf(out, "  \"leaked_blocks\": %zu,\n  \"leaked_bytes\": %zu,\n",
+          leaked_blocks, leaked_bytes);
+
+  fprintf(out, "  \"size_classes\": [");
+  sep = "";
+  for (int k = 0; k < NUM_SIZE_CLASSES; k++) {
+    if (class_allocs[k] || class_live[k]) {
+      fprintf(out, "%s\n    {\"max_size\": %zu, \"allocs\": %zu, ", sep,
+              (size_t)1 << k, class_allocs[k].load());
+      fprintf(out, "\"live\": %zu}", class_live[k]);
+      sep = ",";
+    }
+  }
+  fprintf(out, "\n  ],\n");
+
+  qsort(groups, num_groups, sizeof(LeakGroup), compare_leak_groups);
+  fprintf(out, "  \"leaks\": [");
+  for (int g = 0; g < num_groups; g++) {
+    fprintf(out, "%s\n    {\"class\": ", g ? "," : "");
+    if (groups[g].name) {
+      fprintf(out, "\"%s\"", groups[g].name);
+    } else {
+      fprintf(out, "null");
+    }
+    fprintf(out, ", \"size\": %zu, \"count\": %zu}", groups[g].size,
+            groups[g].count);
+  }
+  fprintf(out, "\n  ]\n}\n");
+}
+
+// With GC_COLLECT=1, gc.so also frees blocks the program can no longer
+// reach, for binaries that cannot be rebuilt against the collecting runtime.
+// Once live bytes pass a threshold (GC_COLLECT_BYTES, 8MB by default, then
+// twice what survived the last collection), the next malloc first marks every
+// block whose start address appears in a word of the stack, the registers,
+// a writable segment or thread-local block of a loaded object, or an already
+// marked block, and frees the rest. Interior pointers and pointers kept only in mmap'd memory
+// do not keep a block alive. Collection is skipped while the process has
+// more than one thread, since the other stacks cannot be scanned.
+#define DEFAULT_COLLECT_BYTES (8 << 20)
+
+extern "C" void __libc_free(void *ptr);
+extern "C" void *__libc_stack_end;
+
+static size_t collect_bytes = 0; // 0: collection is off
+static size_t next_collect = 0;
+static uint8_t *marks = nullptr;     // one per slot
+static uint32_t *mark_stack = nullptr; // slot indexes
+static size_t mark_top = 0;
+static uintptr_t heap_lo, heap_hi;   // bounds of the tracked blocks
+static size_t collections = 0, collected_blocks = 0, collected_bytes = 0;
+
+// Map the mark bits and mark stack for a table of slots, if collecting
+static bool resize_marks(size_t slots) {
+  if (!collect_bytes) {
+    return true;
+  }
+  uint8_t *new_marks = (uint8_t *)mmap(
+      nullptr, slots, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  uint32_t *new_stack = (uint32_t *)mmap(
+      nullptr, slots * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (new_marks == MAP_FAILED || new_stack == MAP_FAILED) {
+    if (new_marks != MAP_FAILED) {
+      munmap(new_marks, slots);
+    }
+    if (new_stack != MAP_FAILED) {
+      munmap(new_stack, slots * sizeof(uint32_t));
+    }
+    return false;
+  }
+  if (marks) {
+    munmap(marks, table_mask + 1);
+    munmap(mark_stack, (table_mask + 1) * sizeof(uint32_t));
+  }
+  marks = new_marks;
+  mark_stack = new_stack;
+  return true;
+}
+
+// Index of the slot holding ptr, or -1
+static long table_find(uintptr_t ptr) {
+  size_t i = slot_index((void *)ptr);
+  for (size_t probes = 0; probes < max_probes; probes++, i++) {
+    uintptr_t key = table[i & table_mask].key.load(std::memory_order_relaxed);
+    if (key == ptr) {
+      return i & table_mask;
+    }
+    if (key == EMPTY_KEY) {
+      return -1;
+    }
+  }
+  return -1;
+}
+
+static void scan_range(uintptr_t lo, uintptr_t hi) {
+  lo = (lo + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1);
+  for (uintptr_t p = lo; p + sizeof(uintptr_t) <= hi; p += sizeof(uintptr_t)) {
+    uintptr_t word = *(uintptr_t *)p;
+    if (word < heap_lo || word > heap_hi) {
+      continue;
+    }
+    long i = table_find(word);
+    if (i >= 0 && !marks[i]) {
+      marks[i] = 1;
+      mark_stack[mark_top++] = i;
+    }
+  }
+}
+
+static int scan_data_segments(struct dl_phdr_info *info, size_t info_size,
+                              void *) {
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+    // This thread's copy of the object's thread-locals, if it has one yet
+    if (phdr.p_type == PT_TLS &&
+        info_size >= offsetof(struct dl_phdr_info, dlpi_tls_data) +
+                         sizeof(info->dlpi_tls_data) &&
+        info->dlpi_tls_data) {
+      uintptr_t lo = (uintptr_t)info->dlpi_tls_data;
+      scan_range(lo, lo + phdr.p_memsz);
+      continue;
+    }
+    if (phdr.p_type != PT_LOAD || !(phdr.p_flags & PF_W)) {
+      continue;
+    }
+    uintptr_t lo = info->dlpi_addr + phdr.p_vaddr;
+    uintptr_t hi = lo + phdr.p_memsz;
+    // Our own tables would only keep garbage alive
+    if ((uintptr_t)&table >= lo && (uintptr_t)&table < hi) {
+      continue;
+    }
+    scan_range(lo, hi);
+  }
+  return 0;
+}
+
+static bool single_threaded(void) {
+  char buf[512];
+  int fd = open("/proc/self/stat", O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) {
+    return false;
+  }
+  buf[len] = '\0';
+  // num_threads is the 20th field; the 2nd, comm, may contain spaces
+  char *p = strrchr(buf, ')');
+  for (int field = 2; p && field < 20; field++) {
+    p = strchr(p + 1, ' ');
+  }
+  return p && atoi(p + 1) == 1;
+}
+
+// Not inlined, so that every callee-saved register of the callers, which may
+// hold a pointer, is spilled into this frame before it is scanned
+static void __attribute__((noinline)) mark_roots(void) {
+  __builtin_unwind_init();
+  scan_range((uintptr_t)__builtin_frame_address(0),
+             (uintptr_t)__libc_stack_end);
+  dl_iterate_phdr(scan_data_segments, nullptr);
+}
+
+static void collect(void) {
+  heap_lo = UINTPTR_MAX;
+  heap_hi = 0;
+  for (size_t i = 0; i <= table_mask; i++) {
+    uintptr_t key = table[i].key.load(std::memory_order_relaxed);
+    if (key != EMPTY_KEY && key != TOMBSTONE_KEY) {
+      heap_lo = key < heap_lo ? key : heap_lo;
+      heap_hi = key > heap_hi ? key : heap_hi;
+    }
+  }
+
+  mark_top = 0;
+  mark_roots();
+  while (mark_top > 0) {
+    Slot &slot = table[mark_stack[--mark_top]];
+    uintptr_t block = slot.key.load(std::memory_order_relaxed);
+    scan_range(block, block + slot.size.load(std::memory_order_relaxed));
+  }
+
+  size_t freed_blocks = 0, freed_bytes = 0;
+  for (size_t i = 0; i <= table_mask; i++) {
+    uintptr_t key = table[i].key.load(std::memory_order_relaxed);
+    if (key == EMPTY_KEY || key == TOMBSTONE_KEY || marks[i]) {
+      marks[i] = 0;
+      continue;
+    }
+    size_t size;
+    uint32_t stack;
+    if (table_erase((void *)key, &size, &stack)) {
+      release_sample(stack, size);
+      note_free(size);
+      __libc_free((void *)key);
+      freed_blocks++;
+      freed_bytes += size;
+    }
+  }
+
+  collections++;
+  collected_blocks += freed_blocks;
+  collected_bytes += freed_bytes;
+  next_collect = live_bytes.load() * 2;
+  if (next_collect < collect_bytes) {
+    next_collect = collect_bytes;
+  }
+  print_if_enabled("collect() freed %zu blocks (%zu bytes), %zu live\n",
+                   freed_blocks, freed_bytes, live_bytes.load());
+}
+
+static bool enter_hook() {
+  if (in_hook || !activated.load(std::memory_order_relaxed)) {
+    return false;
+  }
+  in_hook = true;
+  return true;
+}
+
+static void leave_hook() { in_hook = false; }
+
+// Collect first if the heap has grown past the threshold
+static void maybe_collect(void) {
+  if (collect_bytes &&
+      live_bytes.load(std::memory_order_relaxed) >= next_collect &&
+      enter_hook()) {
+    if (single_threaded()) {
+      collect();
+    } else {
+      next_collect = live_bytes.load() * 2;
+    }
+    leave_hook();
+  }
+}
+
 extern "C" {
 
 // Underlying malloc implementation not exposed by glibc header
@@ -21,13 +802,13 @@ void *__libc_malloc(size_t size);
 
 // Shadow malloc and calloc implementations.
 void *malloc(size_t size) __THROW __attribute_alloc_size__((1)) __wur {
+  maybe_collect();
   void *alloced = __libc_malloc(size);
-  if (activated) {
-    activated = false;
-    std::lock_guard<std::mutex> lock(mtx);
-    allocs.emplace(alloced, size);
+  if (alloced && enter_hook()) {
+    table_insert(alloced, size, record_sample(size));
+    note_alloc(size);
     print_if_enabled("malloc(%zu) = %p\n", size, alloced);
-    activated = true;
+    leave_hook();
   }
   return alloced;
 }
@@ -38,42 +819,159 @@ void *calloc(size_t nmemb, size_t size) __THROW
   return p ? memset(p, 0, total) : nullptr;
 }
 
+// Aligned blocks are tracked like any other: free() releases them, and the
+// collector must see them or it would free blocks only they point to.
+void *__libc_memalign(size_t alignment, size_t size);
+void *memalign(size_t alignment, size_t size) __THROW
+    __attribute_alloc_size__((2)) __wur {
+  maybe_collect();
+  void *alloced = __libc_memalign(alignment, size);
+  if (alloced && enter_hook()) {
+    table_insert(alloced, size, record_sample(size));
+    note_alloc(size);
+    print_if_enabled("memalign(%zu, %zu) = %p\n", alignment, size, alloced);
+    leave_hook();
+  }
+  return alloced;
+}
+void *aligned_alloc(size_t alignment, size_t size) __THROW
+    __attribute_alloc_size__((2)) __wur {
+  maybe_collect();
+  void *alloced = __libc_memalign(alignment, size);
+  if (alloced && enter_hook()) {
+    table_insert(alloced, size, record_sample(size));
+    note_alloc(size);
+    print_if_enabled("aligned_alloc(%zu, %zu) = %p\n", alignment, size,
+                     alloced);
+    leave_hook();
+  }
+  return alloced;
+}
+int posix_memalign(void **memptr, size_t alignment, size_t size) __THROW {
+  if (alignment % sizeof(void *) != 0 ||
+      (alignment & (alignment - 1)) != 0 || alignment == 0) {
+    return EINVAL;
+  }
+  maybe_collect();
+  void *alloced = __libc_memalign(alignment, size);
+  if (!alloced) {
+    return ENOMEM;
+  }
+  if (enter_hook()) {
+    table_insert(alloced, size, record_sample(size));
+    note_alloc(size);
+    print_if_enabled("posix_memalign(%zu, %zu) = %p\n", alignment, size,
+                     alloced);
+    leave_hook();
+  }
+  *memptr = alloced;
+  return 0;
+}
+
 void *__libc_realloc(void *ptr, size_t size);
 void *realloc(void *ptr, size_t size) __THROW __attribute_alloc_size__((2)) {
   void *alloced = __libc_realloc(ptr, size);
-  if (activated) {
-    activated = false;
-    std::lock_guard<std::mutex> lock(mtx);
-    allocs.erase(ptr);
-    allocs.emplace(alloced, size);
+  if (enter_hook()) {
+    size_t old_size;
+    uint32_t old_stack;
+    // realloc(ptr, 0) frees ptr and returns null; any other null return
+    // leaves ptr allocated
+    if (ptr && (alloced || size == 0) &&
+        table_erase(ptr, &old_size, &old_stack)) {
+      release_sample(old_stack, old_size);
+      note_free(old_size);
+    }
+    if (alloced) {
+      table_insert(alloced, size, record_sample(size));
+      note_alloc(size);
+    }
     print_if_enabled("realloc(%p, %zu) = %p\n", ptr, size, alloced);
-    activated = true;
+    leave_hook();
   }
   return alloced;
 }
 
 void __libc_free(void *ptr);
 void free(void *ptr) __THROW {
-  if (activated) {
-    activated = false;
-    std::lock_guard<std::mutex> lock(mtx);
-    auto it = allocs.find(ptr);
-    if (it == allocs.end()) {
+  if (ptr && enter_hook()) {
+    size_t size;
+    uint32_t stack;
+    if (!table_erase(ptr, &size, &stack)) {
       print_if_enabled("free(%p) (not found)\n", ptr);
     } else {
-      print_if_enabled("free(%p) (size = %zu)\n", ptr, it->second);
-      allocs.erase(it);
+      release_sample(stack, size);
+      note_free(size);
+      print_if_enabled("free(%p) (size = %zu)\n", ptr, size);
     }
-    activated = true;
+    leave_hook();
   }
   __libc_free(ptr);
 }
 
 static void before_main(void) __attribute__((constructor));
 static void before_main(void) {
+  int bits = DEFAULT_TABLE_BITS;
+  char *bits_str = getenv("GC_TABLE_BITS");
+  if (bits_str && atoi(bits_str) >= 10 &&
+      atoi(bits_str) <= MAX_TABLE_BITS) {
+    bits = atoi(bits_str);
+  }
+  size_t slots = (size_t)1 << bits;
+  Slot *slots_mem = map_slots(slots);
+  if (!slots_mem) {
+    fprintf(stderr, "gc.so: cannot map a table of %zu slots\n", slots);
+    return;
+  }
+  use_slots(slots_mem, slots);
+
+  char *sample_str = getenv("GC_SAMPLE_BYTES");
+  if (sample_str && atol(sample_str) > 0) {
+    sample_interval = atol(sample_str);
+    // The first backtrace() loads the unwinder, which allocates
+    void *frame;
+    backtrace(&frame, 1);
+  }
+
+  char *trace_str = getenv("GC_TRACE");
+  if (trace_str) {
+    trace_fd = open(trace_str, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (trace_fd < 0) {
+      fprintf(stderr, "gc.so: cannot open trace file %s\n", trace_str);
+    } else {
+      const char header[] = "time_us,allocs,frees,live_bytes,peak_bytes\n";
+      if (write(trace_fd, header, sizeof(header) - 1) < 0) {
+        trace_fd = -1;
+      }
+    }
+    char *every_str = getenv("GC_TRACE_EVERY");
+    if (every_str && atol(every_str) > 0) {
+      trace_every = atol(every_str);
+    }
+    char *ms_str = getenv("GC_TRACE_MS");
+    if (ms_str && atol(ms_str) > 0) {
+      trace_ns = atol(ms_str) * 1000000L;
+    }
+    start_ns = now_ns();
+    next_trace_ns = start_ns + trace_ns;
+  }
+
+  char *collect_str = getenv("GC_COLLECT");
+  if (collect_str && std::string(collect_str) == "1") {
+    collect_bytes = DEFAULT_COLLECT_BYTES;
+    if (!resize_marks(slots)) {
+      fprintf(stderr, "gc.so: cannot map the collector's mark bits\n");
+      collect_bytes = 0;
+    } else {
+      char *bytes_str = getenv("GC_COLLECT_BYTES");
+      if (bytes_str && atol(bytes_str) > 0) {
+        collect_bytes = atol(bytes_str);
+      }
+      next_collect = collect_bytes;
+    }
+  }
+
   char* print_malloc_str = getenv("PRINT_MALLOC");
   if (print_malloc_str && std::string(print_malloc_str) == "1") {
-    std::lock_guard<std::mutex> lock(mtx);
     print_malloc = true;
     print_if_enabled("hook before entering main()\n");
   }
@@ -83,18 +981,49 @@ static void before_main(void) {
 static void after_main(void) __attribute__((destructor));
 static void after_main(void) {
   activated = false;
+  if (!table) {
+    return;
+  }
   print_if_enabled("hook after exiting main()\n");
-  mtx.lock();
-  bool found_printf_malloc = false;
-  for (auto &[ptr, size] : allocs) {
-    // printf likes to allocate a buffer at the first use, so ignore it.
-    if (!found_printf_malloc && size > 512) {
-      found_printf_malloc = true;
+  char *report_str = getenv("GC_REPORT");
+  if (report_str && std::string(report_str) == "json") {
+    char *file_str = getenv("GC_REPORT_FILE");
+    FILE *out = file_str ? fopen(file_str, "w") : stdout;
+    if (!out) {
+      fprintf(stderr, "gc.so: cannot open report file %s\n", file_str);
     } else {
-      printf("leak: %p (size = %zu)\n", ptr, size);
+      print_json_report(out);
+      if (out != stdout) {
+        fclose(out);
+      }
+    }
+  } else {
+    for (size_t i = 0; i <= table_mask; i++) {
+      uintptr_t key = table[i].key.load(std::memory_order_acquire);
+      if (key == EMPTY_KEY || key == TOMBSTONE_KEY || allowed_buffer(key)) {
+        continue;
+      }
+      size_t size = table[i].size.load(std::memory_order_acquire);
+      printf("leak: %p (size = %zu)\n", (void *)key, size);
     }
   }
-  mtx.unlock();
+  if (collections) {
+    fprintf(stderr, "gc.so: %zu collections freed %zu blocks (%zu bytes)\n",
+            collections, collected_blocks, collected_bytes);
+  }
+  if (trace_fd >= 0) {
+    write_trace_row(now_ns());
+    close(trace_fd);
+    fprintf(stderr, "gc.so: peak live bytes %zu\n", peak_bytes.load());
+  }
+  if (sample_interval) {
+    print_profile();
+  }
+  if (dropped) {
+    fprintf(stderr,
+            "gc.so: table cannot grow, %zu allocations were not tracked\n",
+            dropped.load());
+  }
 }
 
 } // extern "C"
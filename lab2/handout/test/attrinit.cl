@@ -0,0 +1,51 @@
+class A {
+  trail : String <- "A";
+  a1 : Int <- step("a1", 1);
+  a2 : Int <- step("a2", a1 + 1);
+  kind : String <- kind_name();
+  step(s : String, v : Int) : Int { { trail <- trail.concat(" ").concat(s); v; } };
+  kind_name() : String { "A-kind" };
+  fresh() : SELF_TYPE { new SELF_TYPE };
+  trail() : String { trail };
+  kind() : String { kind };
+  a2() : Int { a2 };
+};
+class B inherits A {
+  b1 : Int <- step("b1", a2 * 10);
+  b2 : String <- trail.concat("!");
+  late : Int <- peek();
+  unset : Int <- 5;
+  flag : Bool;
+  text : String;
+  obj : Object;
+  peek() : Int { unset };
+  kind_name() : String { "B-kind" };
+  b1() : Int { b1 };
+  b2() : String { b2 };
+  late() : Int { late };
+  unset() : Int { unset };
+  defaults() : Bool { if flag then false else text.length() = 0 fi };
+  obj() : Object { obj };
+};
+class Main inherits IO {
+  show(b : B) : Object {
+    {
+      out_string(b.type_name()); out_string(": ");
+      out_string(b.trail()); out_string(" | ");
+      out_string(b.b2()); out_string(" | ");
+      out_string(b.kind()); out_string(" | ");
+      out_int(b.a2()); out_string(" "); out_int(b.b1()); out_string(" ");
+      out_int(b.late()); out_string(" "); out_int(b.unset()); out_string(" ");
+      if b.defaults() then out_string("defaults ") else out_string("set ") fi;
+      if isvoid b.obj() then out_string("void\n") else out_string("object\n") fi;
+    }
+  };
+  main() : Object {
+    let b : B <- new B, a : A <- new A in {
+      show(b);
+      show(b.fresh());
+      out_string(a.trail()); out_string(" | "); out_string(a.kind());
+      out_string("\n");
+    }
+  };
+};
@@ -0,0 +1,19 @@
+class Main inherits IO {
+  id(x : Int) : Int { x };
+  show(x : Int) : Object { { out_int(x); out_string(" "); } };
+  main() : Object {
+    let min : Int <- ~2147483647 - 1 in {
+      show(7 / 2); show(~7 / 2); show(7 / ~2); show((2 + 3) * 4);
+      show(10 - 20); show(2147483647 + 1); show(~(~5));
+      if 3 < 4 then out_string("yes ") else out_string("no ") fi;
+      if not (1 = 2) then out_string("ne\n") else out_string("eq\n") fi;
+      show((~2147483647 - 1) / ~1); show(min / ~1); show(id(min) / ~1);
+      show(id(2147483647) / ~1); show(id(min) / 1); out_string("\n");
+      show(id(100) / 1); show(id(100) / 7); show(id(~100) / 7);
+      show(id(100) / id(~3)); out_string("\n");
+      out_string("before\n");
+      show(id(5) / 0);
+      out_string("after\n");
+    }
+  };
+};
@@ -0,0 +1,33 @@
+class Node {
+  v : Int;
+  next : Node;
+  s : String;
+  init(x : Int, n : Node, str : String) : Node { { v <- x; next <- n; s <- str; self; } };
+  v() : Int { v };
+  next() : Node { next };
+  s() : String { s };
+  sum(a : Node, b : Node) : Int { v + a.v() + b.v() };
+  pick(o : Object, n : Node) : Int { case o of x : Int => x + n.v(); y : Object => 0 - 1; esac };
+};
+class Main inherits IO {
+  junk(n : Int) : Node {
+    let i : Int <- 0, l : Node in {
+      while i < n loop { l <- (new Node).init(i, l, "x".concat("y")); i <- i + 1; } pool;
+      l;
+    }
+  };
+  main() : Object {
+    let l : Node, i : Int <- 0, total : Int <- 0, same : Int <- 0, len : Int <- 0 in {
+      while i < 20000 loop {
+        total <- total + (new Node).init(i, junk(5), "a").sum((new Node).init(1, junk(3), "b"), (new Node).init(2, junk(3), "c"));
+        total <- total + (new Node).pick(i + 5000, (new Node).init(3, junk(2), "d"));
+        l <- (new Node).init(i, l, "s".concat(i.type_name()));
+        if l = junk(2) then same <- same + 100 else same <- same + 1 fi;
+        if l.s() = "s".concat("Int") then same <- same + 1 else same <- same + 1000 fi;
+        i <- i + 1;
+      } pool;
+      while not isvoid l loop { total <- total + l.v(); len <- len + l.s().length(); l <- l.next(); } pool;
+      out_int(total); out_string(" "); out_int(same); out_string(" "); out_int(len); out_string("\n");
+    }
+  };
+};
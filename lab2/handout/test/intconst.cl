@@ -0,0 +1,39 @@
+class Box {
+  o : Object;
+  set(x : Object) : Box { { o <- x; self; } };
+  get() : Object { o };
+};
+class Main inherits IO {
+  show(x : Object) : Object {
+    case x of
+      i : Int => { out_int(i); out_string(" "); };
+      s : String => { out_string(s); out_string(" "); };
+      o : Object => out_string("? ");
+    esac
+  };
+  total(x : Object, n : Int) : Int {
+    let t : Int <- 0, i : Int <- 0 in {
+      while i < n loop {
+        case x of k : Int => t <- t + k; o : Object => t <- 0 - 1; esac;
+        i <- i + 1;
+      } pool;
+      t;
+    }
+  };
+  churn(n : Int) : Object {
+    let i : Int <- 0, b : Box in {
+      while i < n loop { b <- (new Box).set("a".concat("b")); i <- i + 1; } pool;
+      b;
+    }
+  };
+  main() : Object {
+    let b : Box <- (new Box).set(123456789), o : Object <- 2147483647,
+        p : Object <- 7 in {
+      show(b.get()); show(o); show(p); show(~5); show(3 + 4); show("s");
+      out_string(o.type_name()); out_string("\n");
+      churn(100000);
+      show(b.get()); show((new Box).set(123456789).get());
+      out_int(total(1000, 1000)); out_string("\n");
+    }
+  };
+};
@@ -0,0 +1,15 @@
+class Main inherits IO {
+  count : Int;
+  f() : Object { let i : Int <- 0 in while i < 3 loop i <- i + 1 pool };
+  g() : Object { while false loop out_string("x") pool };
+  h() : Object { while count < 5 loop count <- count + 1 pool };
+  main() : Object {
+    {
+      if isvoid f() then out_string("void\n") else out_string("value\n") fi;
+      if isvoid g() then out_string("void\n") else out_string("value\n") fi;
+      if isvoid (while false loop 1 pool) then out_string("void\n") else out_string("value\n") fi;
+      h();
+      out_int(count); out_string("\n");
+    }
+  };
+};
@@ -0,0 +1,9 @@
+class Main inherits IO {
+  main() : Object {
+    let n : Int <- in_int(), count : Int <- 0, sum : Int <- 0 in {
+      while not n = 0 loop { count <- count + 1; sum <- sum + n; n <- in_int(); } pool;
+      out_int(count); out_string(" "); out_int(sum); out_string(" ");
+      out_int(in_string().length()); out_string("\n");
+    }
+  };
+};
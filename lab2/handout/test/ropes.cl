@@ -0,0 +1,40 @@
+class Main inherits IO {
+  build(n : Int, piece : String) : String {
+    let s : String <- "", i : Int <- 0 in {
+      while i < n loop { s <- s.concat(piece); i <- i + 1; } pool;
+      s;
+    }
+  };
+  prepend(n : Int, piece : String) : String {
+    let s : String <- "", i : Int <- 0 in {
+      while i < n loop { s <- piece.concat(s); i <- i + 1; } pool;
+      s;
+    }
+  };
+  count(s : String, c : String) : Int {
+    let i : Int <- 0, k : Int <- 0 in {
+      while i < s.length() loop {
+        if s.substr(i, 1) = c then k <- k + 1 else 0 fi;
+        i <- i + 1;
+      } pool;
+      k;
+    }
+  };
+  main() : Object {
+    let a : String <- build(1000, "xyz") in {
+      out_int(a.length()); out_string("\n");
+      out_string(a.substr(1500, 6)); out_string("\n");
+      if a = build(500, "xyz").concat(build(500, "xyz"))
+      then out_string("same\n") else out_string("different\n") fi;
+      if prepend(100, "ab") = build(100, "ab")
+      then out_string("same\n") else out_string("different\n") fi;
+      if a = build(999, "xyz").concat("xyy")
+      then out_string("same\n") else out_string("different\n") fi;
+      out_string(build(40, "ab").concat("!\n"));
+      out_int(count(build(100, "xyz"), "z")); out_string("\n");
+      out_int(build(20000, "abcde").length()); out_string("\n");
+      out_string(build(30, "abc").concat(build(30, "def")).substr(88, 4));
+      out_string("\n");
+    }
+  };
+};
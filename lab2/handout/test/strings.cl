@@ -0,0 +1,19 @@
+class Main inherits IO {
+  main() : Object {
+    let s : String <- "hello", t : String <- s.concat(" world"), e : String <- "" in {
+      out_int(s.length()); out_string(" ");
+      out_int(t.length()); out_string(" ");
+      out_int(e.length()); out_string("\n");
+      out_string(t.substr(6, 5)); out_string("|");
+      out_string(t.substr(0, 0)); out_string("|");
+      out_string(t.substr(4, 3)); out_string("\n");
+      if t.substr(0, 5) = s then out_string("eq\n") else out_string("ne\n") fi;
+      if e = "" then out_string("empty\n") else out_string("nonempty\n") fi;
+      if s = "help" then out_string("eq\n") else out_string("ne\n") fi;
+      out_int(t.substr(6, 5).concat(s).length()); out_string("\n");
+      out_int(e.concat(e).length()); out_string("\n");
+      out_string("tab\there\n");
+      out_string(s.type_name().concat(t.type_name())); out_string("\n");
+    }
+  };
+};